@@ -27,6 +27,8 @@
 #include <vector>
 
 #include <dtree/hashset.h>
+#include <dtree/scratch.h>
+#include <dtree/snapshot.h>
 
 #ifndef dtree_likely
 #   define dtree_likely(x) __builtin_expect((x),1)
@@ -48,6 +50,54 @@ public:
         _hashSet.init();
     }
 
+    /**
+     * @brief Writes the table and @p flags to a Snapshot at @p path. No thread may insert meanwhile.
+     */
+    bool save(const char* path, uint64_t flags = 0) const {
+        return Snapshot::save(path, flags, _hashSet);
+    }
+
+    /**
+     * @brief Maps the table of the Snapshot at @p path, instead of init(). Indices of the saved tree are
+     * valid in this tree.
+     */
+    bool open(const char* path, uint64_t& flags) {
+        return Snapshot::open(path, flags, _hashSet);
+    }
+
+    /**
+     * @brief Writes the occupied buckets of the table and @p flags to a compact Snapshot at @p path, using
+     * up to @p threads threads. No thread may insert meanwhile.
+     */
+    bool saveCompact(const char* path, uint64_t flags = 0, size_t threads = 0) const {
+        return Snapshot::saveCompact(path, flags, threads, _hashSet);
+    }
+
+    /**
+     * @brief Loads the compact Snapshot at @p path into fresh tables, instead of init(), using up to
+     * @p threads threads.
+     */
+    bool openCompact(const char* path, uint64_t& flags, size_t threads = 0) {
+        return Snapshot::openCompact(path, flags, threads, _hashSet);
+    }
+
+    /**
+     * @brief Logs the newly inserted nodes to @p log, or stops logging if @p log is nullptr.
+     */
+    void setWriteAheadLog(WriteAheadLog* log) {
+        _hashSet.setWriteAheadLog(log, 0);
+    }
+
+    /**
+     * @brief Puts the nodes logged to the WriteAheadLog at @p path back at their IDs, after init() or open().
+     * @return The number of nodes replayed.
+     */
+    size_t replay(const char* path) {
+        return WriteAheadLog::replay(path, [this](uint32_t, uint64_t id, uint64_t key, uint64_t key2) {
+            _hashSet.restore(id, key, key2);
+        });
+    }
+
     static constexpr uint64_t NotFound() {
         return HS::NotFound();
     }
@@ -56,6 +106,38 @@ public:
         _hashSet.setScale(scale);
     }
 
+    void setScanThreads(size_t threads) {
+        _hashSet.setScanThreads(threads);
+    }
+
+    void setCountElements(bool count) {
+        _hashSet.setCountElements(count);
+    }
+
+    void setPagePolicy(MMapper::Pages policy) {
+        _hashSet.setPagePolicy(policy);
+    }
+
+    MMapper::Pages getPageBacking(size_t map) const {
+        return _hashSet.getPageBacking();
+    }
+
+    void setNumaPolicy(MMapper::NumaPolicy numa) {
+        _hashSet.setNumaPolicy(numa);
+    }
+
+    void setPrefault(MMapper::Prefault mode, size_t threads = 0) {
+        _hashSet.setPrefault(mode, threads);
+    }
+
+    void getNodeStats(std::vector<size_t>& pages, size_t map) const {
+        _hashSet.getNodeStats(pages);
+    }
+
+    size_t getElementsApprox() const {
+        return _hashSet.getElementsApprox();
+    }
+
     size_t getScale() const {
         return _hashSet._scale;
     }
@@ -66,6 +148,15 @@ protected:
         return _hashSet.insert(v);
     }
 
+    /**
+     * @brief Inserts the @p n independent nodes in @p v, writing their 32-bit IDs to @p out. @p out may
+     * overlap @p v, as long as out[i] does not lie past v[i].
+     */
+    __attribute__((always_inline))
+    void storage_fop_batch(const uint64_t* v, uint32_t* out, uint32_t n) {
+        _hashSet.insertBatch(v, out, n);
+    }
+
     __attribute__((always_inline))
     uint64_t storage_find(uint64_t v, uint32_t, bool) {
         return _hashSet.find(v);
@@ -77,6 +168,14 @@ protected:
         return _hashSet.get(idx);
     }
 
+    /**
+     * @brief Reads the nodes of the @p n IDs in @p idx into @p out, which may expand @p idx in place.
+     */
+    __attribute__((always_inline))
+    void storage_get_batch(const uint32_t* idx, uint64_t* out, uint32_t n) {
+        _hashSet.getBatch(idx, out, n);
+    }
+
 public:
     typename HS::mapStats getStats() {
         typename HS::mapStats stats;
@@ -94,6 +193,10 @@ public:
     void getDensityStats(size_t bars, CONTAINER& elements, size_t map) {
         _hashSet.getDensityStats(bars, elements);
     }
+
+    typename HS::probeHistograms getProbeHistograms(size_t map) {
+        return _hashSet.getProbeHistograms();
+    }
 protected:
     HS _hashSet;
 };
@@ -117,6 +220,77 @@ public:
         _hashSet.setScale(scale);
     }
 
+    /**
+     * @brief Sets the number of threads the statistics scans of both tables use.
+     */
+    void setScanThreads(size_t threads) {
+        _hashSetRoot.setScanThreads(threads);
+        _hashSet.setScanThreads(threads);
+    }
+
+    void setCountElements(bool count) {
+        _hashSetRoot.setCountElements(count);
+        _hashSet.setCountElements(count);
+    }
+
+    /**
+     * @brief Sets the largest pages both tables may be backed with. Must be called before init().
+     */
+    void setPagePolicy(MMapper::Pages policy) {
+        _hashSetRoot.setPagePolicy(policy);
+        _hashSet.setPagePolicy(policy);
+    }
+
+    /**
+     * @brief Returns the pages that back the root table if @p map is 0, the data table otherwise.
+     */
+    MMapper::Pages getPageBacking(size_t map) const {
+        return map == 0 ? _hashSetRoot.getPageBacking() : _hashSet.getPageBacking();
+    }
+
+    /**
+     * @brief Places the pages of both tables over NUMA nodes. Must be called before init().
+     */
+    void setNumaPolicy(MMapper::NumaPolicy numa) {
+        _hashSetRoot.setNumaPolicy(numa);
+        _hashSet.setNumaPolicy(numa);
+    }
+
+    void setRootNumaPolicy(MMapper::NumaPolicy numa) {
+        _hashSetRoot.setNumaPolicy(numa);
+    }
+
+    void setDataNumaPolicy(MMapper::NumaPolicy numa) {
+        _hashSet.setNumaPolicy(numa);
+    }
+
+    /**
+     * @brief Backs both tables before use, see MMapper::prefault(). Must be called before init().
+     */
+    void setPrefault(MMapper::Prefault mode, size_t threads = 0) {
+        _hashSetRoot.setPrefault(mode, threads);
+        _hashSet.setPrefault(mode, threads);
+    }
+
+    /**
+     * @brief Adds the NUMA nodes of sampled pages of the root table if @p map is 0, of the data table
+     * otherwise, to @p pages.
+     */
+    void getNodeStats(std::vector<size_t>& pages, size_t map) const {
+        if(map == 0) {
+            _hashSetRoot.getNodeStats(pages);
+        } else {
+            _hashSet.getNodeStats(pages);
+        }
+    }
+
+    /**
+     * @brief Returns the number of elements of both tables counted since setCountElements(true).
+     */
+    size_t getElementsApprox() const {
+        return _hashSetRoot.getElementsApprox() + _hashSet.getElementsApprox();
+    }
+
     size_t getRootScale() const {
         return _hashSetRoot._scale;
     }
@@ -130,6 +304,60 @@ public:
         _hashSet.init();
     }
 
+    /**
+     * @brief Writes both tables and @p flags to a Snapshot at @p path. No thread may insert meanwhile.
+     */
+    bool save(const char* path, uint64_t flags = 0) const {
+        return Snapshot::save(path, flags, _hashSetRoot, _hashSet);
+    }
+
+    /**
+     * @brief Maps both tables of the Snapshot at @p path, instead of init(). Indices of the saved tree are
+     * valid in this tree.
+     */
+    bool open(const char* path, uint64_t& flags) {
+        return Snapshot::open(path, flags, _hashSetRoot, _hashSet);
+    }
+
+    /**
+     * @brief Writes the occupied buckets of both tables and @p flags to a compact Snapshot at @p path, using
+     * up to @p threads threads. No thread may insert meanwhile.
+     */
+    bool saveCompact(const char* path, uint64_t flags = 0, size_t threads = 0) const {
+        return Snapshot::saveCompact(path, flags, threads, _hashSetRoot, _hashSet);
+    }
+
+    /**
+     * @brief Loads the compact Snapshot at @p path into fresh tables, instead of init(), using up to
+     * @p threads threads.
+     */
+    bool openCompact(const char* path, uint64_t& flags, size_t threads = 0) {
+        return Snapshot::openCompact(path, flags, threads, _hashSetRoot, _hashSet);
+    }
+
+    /**
+     * @brief Logs the newly inserted nodes of both tables to @p log, or stops logging if @p log is nullptr.
+     */
+    void setWriteAheadLog(WriteAheadLog* log) {
+        _hashSetRoot.setWriteAheadLog(log, 0);
+        _hashSet.setWriteAheadLog(log, 1);
+    }
+
+    /**
+     * @brief Puts the nodes logged to the WriteAheadLog at @p path back at their IDs in both tables, after
+     * init() or open().
+     * @return The number of nodes replayed.
+     */
+    size_t replay(const char* path) {
+        return WriteAheadLog::replay(path, [this](uint32_t table, uint64_t id, uint64_t key, uint64_t key2) {
+            if(table == 0) {
+                _hashSetRoot.restore(id, key, key2);
+            } else {
+                _hashSet.restore(id, key, key2);
+            }
+        });
+    }
+
     static constexpr uint64_t NotFound() {
         return HS::NotFound();
     }
@@ -145,6 +373,14 @@ protected:
         else return _hashSet.insert(v);
     }
 
+    /**
+     * @brief Inserts the @p n independent non-root nodes in @p v, writing their 32-bit IDs to @p out.
+     */
+    __attribute__((always_inline))
+    void storage_fop_batch(const uint64_t* v, uint32_t* out, uint32_t n) {
+        _hashSet.insertBatch(v, out, n);
+    }
+
     __attribute__((always_inline))
     uint64_t storage_find(uint64_t v, uint32_t, uint64_t length, bool isRoot = false) {
         if(dtree_unlikely(isRoot)) {
@@ -166,6 +402,14 @@ protected:
         return _hashSet.get(idx);
     }
 
+    /**
+     * @brief Reads the non-root nodes of the @p n IDs in @p idx into @p out, which may expand @p idx in place.
+     */
+    __attribute__((always_inline))
+    void storage_get_batch(const uint32_t* idx, uint64_t* out, uint32_t n) {
+        _hashSet.getBatch(idx, out, n);
+    }
+
 public:
     typename HS::mapStats getStats() {
         typename HS::mapStats stats;
@@ -189,6 +433,14 @@ public:
         return stats;
     }
 
+    typename HS::probeStats getRootProbeStats() {
+        return _hashSetRoot.getProbeStats();
+    }
+
+    typename HS::probeStats getDataProbeStats() {
+        return _hashSet.getProbeStats();
+    }
+
     template<typename CONTAINER>
     typename HS::mapStats getDensityStats(size_t bars, CONTAINER& elements, size_t map) {
         if(map == 0) {
@@ -198,6 +450,17 @@ public:
         }
     }
 
+    /**
+     * @brief Returns the probe histograms of the root table if @p map is 0, of the data table otherwise.
+     */
+    typename HS::probeHistograms getProbeHistograms(size_t map) {
+        if(map == 0) {
+            return _hashSetRoot.getProbeHistograms();
+        } else {
+            return _hashSet.getProbeHistograms();
+        }
+    }
+
     void getAllSizes(std::unordered_map<size_t,size_t>& allSizes) {
         _hashSetRoot.forAll([&allSizes](size_t v, size_t v2) {
             size_t length = v2 & 0x7FFFFFFFFFFFFFFFULL;
@@ -229,6 +492,77 @@ public:
         _hashSet.setScale(scale);
     }
 
+    /**
+     * @brief Sets the number of threads the statistics scans of both tables use.
+     */
+    void setScanThreads(size_t threads) {
+        _hashSetRoot.setScanThreads(threads);
+        _hashSet.setScanThreads(threads);
+    }
+
+    void setCountElements(bool count) {
+        _hashSetRoot.setCountElements(count);
+        _hashSet.setCountElements(count);
+    }
+
+    /**
+     * @brief Sets the largest pages both tables may be backed with. Must be called before init().
+     */
+    void setPagePolicy(MMapper::Pages policy) {
+        _hashSetRoot.setPagePolicy(policy);
+        _hashSet.setPagePolicy(policy);
+    }
+
+    /**
+     * @brief Returns the pages that back the root table if @p map is 0, the data table otherwise.
+     */
+    MMapper::Pages getPageBacking(size_t map) const {
+        return map == 0 ? _hashSetRoot.getPageBacking() : _hashSet.getPageBacking();
+    }
+
+    /**
+     * @brief Places the pages of both tables over NUMA nodes. Must be called before init().
+     */
+    void setNumaPolicy(MMapper::NumaPolicy numa) {
+        _hashSetRoot.setNumaPolicy(numa);
+        _hashSet.setNumaPolicy(numa);
+    }
+
+    void setRootNumaPolicy(MMapper::NumaPolicy numa) {
+        _hashSetRoot.setNumaPolicy(numa);
+    }
+
+    void setDataNumaPolicy(MMapper::NumaPolicy numa) {
+        _hashSet.setNumaPolicy(numa);
+    }
+
+    /**
+     * @brief Backs both tables before use, see MMapper::prefault(). Must be called before init().
+     */
+    void setPrefault(MMapper::Prefault mode, size_t threads = 0) {
+        _hashSetRoot.setPrefault(mode, threads);
+        _hashSet.setPrefault(mode, threads);
+    }
+
+    /**
+     * @brief Adds the NUMA nodes of sampled pages of the root table if @p map is 0, of the data table
+     * otherwise, to @p pages.
+     */
+    void getNodeStats(std::vector<size_t>& pages, size_t map) const {
+        if(map == 0) {
+            _hashSetRoot.getNodeStats(pages);
+        } else {
+            _hashSet.getNodeStats(pages);
+        }
+    }
+
+    /**
+     * @brief Returns the number of elements of both tables counted since setCountElements(true).
+     */
+    size_t getElementsApprox() const {
+        return _hashSetRoot.getElementsApprox() + _hashSet.getElementsApprox();
+    }
+
     size_t getRootScale() const {
         return _hashSetRoot._scale;
     }
@@ -242,6 +576,60 @@ public:
         _hashSet.init();
     }
 
+    /**
+     * @brief Writes both tables and @p flags to a Snapshot at @p path. No thread may insert meanwhile.
+     */
+    bool save(const char* path, uint64_t flags = 0) const {
+        return Snapshot::save(path, flags, _hashSetRoot, _hashSet);
+    }
+
+    /**
+     * @brief Maps both tables of the Snapshot at @p path, instead of init(). Indices of the saved tree are
+     * valid in this tree.
+     */
+    bool open(const char* path, uint64_t& flags) {
+        return Snapshot::open(path, flags, _hashSetRoot, _hashSet);
+    }
+
+    /**
+     * @brief Writes the occupied buckets of both tables and @p flags to a compact Snapshot at @p path, using
+     * up to @p threads threads. No thread may insert meanwhile.
+     */
+    bool saveCompact(const char* path, uint64_t flags = 0, size_t threads = 0) const {
+        return Snapshot::saveCompact(path, flags, threads, _hashSetRoot, _hashSet);
+    }
+
+    /**
+     * @brief Loads the compact Snapshot at @p path into fresh tables, instead of init(), using up to
+     * @p threads threads.
+     */
+    bool openCompact(const char* path, uint64_t& flags, size_t threads = 0) {
+        return Snapshot::openCompact(path, flags, threads, _hashSetRoot, _hashSet);
+    }
+
+    /**
+     * @brief Logs the newly inserted nodes of both tables to @p log, or stops logging if @p log is nullptr.
+     */
+    void setWriteAheadLog(WriteAheadLog* log) {
+        _hashSetRoot.setWriteAheadLog(log, 0);
+        _hashSet.setWriteAheadLog(log, 1);
+    }
+
+    /**
+     * @brief Puts the nodes logged to the WriteAheadLog at @p path back at their IDs in both tables, after
+     * init() or open().
+     * @return The number of nodes replayed.
+     */
+    size_t replay(const char* path) {
+        return WriteAheadLog::replay(path, [this](uint32_t table, uint64_t id, uint64_t key, uint64_t key2) {
+            if(table == 0) {
+                _hashSetRoot.restore(id, key, key2);
+            } else {
+                _hashSet.restore(id, key, key2);
+            }
+        });
+    }
+
     static constexpr uint64_t NotFound() {
         return HS::NotFound();
     }
@@ -258,6 +646,14 @@ protected:
         else return _hashSet.insert(v);
     }
 
+    /**
+     * @brief Inserts the @p n independent non-root nodes in @p v, writing their 32-bit IDs to @p out.
+     */
+    __attribute__((always_inline))
+    void storage_fop_batch(const uint64_t* v, uint32_t* out, uint32_t n) {
+        _hashSet.insertBatch(v, out, n);
+    }
+
     __attribute__((always_inline))
     uint64_t storage_find(uint64_t v, uint32_t, uint64_t length, bool isRoot = false) {
         if(dtree_unlikely(isRoot)) {
@@ -279,6 +675,14 @@ protected:
         return _hashSet.get(idx);
     }
 
+    /**
+     * @brief Reads the non-root nodes of the @p n IDs in @p idx into @p out, which may expand @p idx in place.
+     */
+    __attribute__((always_inline))
+    void storage_get_batch(const uint32_t* idx, uint64_t* out, uint32_t n) {
+        _hashSet.getBatch(idx, out, n);
+    }
+
 public:
     typename HS::mapStats getStats() {
         typename HS::mapStats stats;
@@ -302,6 +706,14 @@ public:
         return stats;
     }
 
+    typename HS::probeStats getRootProbeStats() {
+        return _hashSetRoot.getProbeStats();
+    }
+
+    typename HS::probeStats getDataProbeStats() {
+        return _hashSet.getProbeStats();
+    }
+
     template<typename CONTAINER>
     typename HS::mapStats getDensityStats(size_t bars, CONTAINER& elements, size_t map) {
         if(map == 0) {
@@ -311,6 +723,17 @@ public:
         }
     }
 
+    /**
+     * @brief Returns the probe histograms of the root table if @p map is 0, of the data table otherwise.
+     */
+    typename HS::probeHistograms getProbeHistograms(size_t map) {
+        if(map == 0) {
+            return _hashSetRoot.getProbeHistograms();
+        } else {
+            return _hashSet.getProbeHistograms();
+        }
+    }
+
     void getAllSizes(std::unordered_map<size_t,size_t>& allSizes) {
     }
 
@@ -319,6 +742,13 @@ protected:
     HS _hashSet;
 };
 
+/**
+ * Separate root and data hash sets that grow when needed while keeping IDs stable, see SegmentedHashSet.
+ * The scale set is that of the first segment.
+ */
+template<typename HS>
+using SeparateRootSegmentedHashSet = SeparateRootSingleHashSet<SegmentedHashSet<HS>, SegmentedHashSet<HS>>;
+
 template<typename HS>
 class MultiLevelhashSet {
 public:
@@ -384,8 +814,16 @@ protected:
     std::vector<HS> _hashSets;
 };
 
+/**
+ * Index of a vector: bits 0-37 hold the ID of its root, bits 38-39 the number of bytes used of its last unit
+ * if its length in bytes is not a multiple of 4, 0 otherwise, and bits 40-63 its length in 32-bit units.
+ * Vectors are thus at most MAX_LENGTH units long, about 16.7 million; the insert functions of dtree assert this.
+ */
 struct DTreeIndex {
 public:
+    static constexpr size_t MAX_LENGTH = (1ULL << 24) - 1;
+    static constexpr uint64_t ID_MASK = (1ULL << 38) - 1;
+
     static constexpr DTreeIndex NotFound() {
         return DTreeIndex(0ULL);
     }
@@ -395,7 +833,10 @@ public:
 
     constexpr DTreeIndex(uint64_t const& d): _data(d) {}
 
-    constexpr DTreeIndex(size_t id, size_t length): _data((id & 0x000000FFFFFFFFFF) | (length << 40)) {}
+    constexpr DTreeIndex(size_t id, size_t length): _data((id & ID_MASK) | (length << 40)) {
+        assert(id <= ID_MASK);
+        assert(length <= MAX_LENGTH);
+    }
 
 public:
     uint64_t getData() const { return _data; }
@@ -418,7 +859,7 @@ public:
     }
 
     uint64_t getID() const {
-        return _data & 0x000000FFFFFFFFFF;
+        return _data & ID_MASK;
     }
 
     uint64_t getLength() const {
@@ -426,10 +867,28 @@ public:
     }
 
     void setLength(size_t length) {
-        _data &= 0x000000FFFFFFFFFF;
+        assert(length <= MAX_LENGTH);
+        _data &= 0x000000FFFFFFFFFFULL;
         _data |= (length << 40);
     }
 
+    /**
+     * @brief The number of bytes used of the last 32-bit unit, or 0 if all of them are used.
+     */
+    uint32_t getTailBytes() const {
+        return (_data >> 38) & 0x3;
+    }
+
+    void setTailBytes(uint32_t tailBytes) {
+        _data &= ~(0x3ULL << 38);
+        _data |= (uint64_t)(tailBytes & 0x3) << 38;
+    }
+
+    uint64_t getLengthInBytes() const {
+        uint32_t tail = getTailBytes();
+        return getLength() * sizeof(uint32_t) - (tail ? sizeof(uint32_t) - tail : 0);
+    }
+
 public:
     friend std::ostream& operator<<(std::ostream& os, DTreeIndex const& state) {
         os << "<";
@@ -667,8 +1126,13 @@ public:
     static constexpr bool REPORT = 0;
 
     /**
-     * Index is a unique mapping to a vector. The upper 32 bits are the
-     * length of the vector, the lower 32 bits are the unique index.
+     * The maximum number of levels of the tree of a vector, plus one for its leaves. This bounds the work
+     * lists of the iterative tree walks.
+     */
+    static constexpr uint32_t MAX_DEPTH = 33;
+
+    /**
+     * Index is a unique mapping to a vector, holding the ID of its root and its length, see DTreeIndex.
      */
     using Index = INDEX;
     using IndexInserted = INDEXINSERTED;
@@ -822,9 +1286,9 @@ public:
             SingleProjection(uint32_t options, uint32_t length, std::initializer_list<uint32_t> offsets) {
                 int i = 0;
                 for(auto& o: offsets) {
-                    _data[i++].init(options, o);
+                    _data[i++].init(o, options);
                 }
-                lando.init(i, length); // TODO: determine if we want nr of offsets or stride
+                lando.init(length, i);
             }
 
             typename MultiOffset::Options getOptions() const {
@@ -908,6 +1372,27 @@ public:
         uint32_t _projections[];
     };
 
+    /**
+     * @brief A part of a vector in its own buffer, for insertFragments() and getFragments().
+     */
+    struct Fragment {
+    public:
+        constexpr Fragment(): _data(nullptr), _length(0) {}
+        constexpr Fragment(uint32_t* data, uint32_t length): _data(data), _length(length) {}
+    public:
+
+        uint32_t* getData() const {
+            return _data;
+        }
+
+        uint32_t getLength() const {
+            return _length;
+        }
+
+        uint32_t* _data;
+        uint32_t _length;
+    };
+
     struct DTreeNode {
     public:
         constexpr DTreeNode(): _data(0) {}
@@ -1000,6 +1485,47 @@ public:
     }
 
     std::atomic<bool> insertedZeroes;
+
+    /**
+     * @brief Writes the tree to a Snapshot at @p path. No thread may insert meanwhile.
+     * @return Whether the snapshot was written.
+     */
+    bool save(const char* path) const {
+        return Storage::save(path, insertedZeroes.load(std::memory_order_relaxed));
+    }
+
+    /**
+     * @brief Opens the Snapshot at @p path, instead of init(). The Indices of the tree that was saved are
+     * valid in this tree.
+     * @return Whether the snapshot was opened.
+     */
+    bool open(const char* path) {
+        uint64_t flags;
+        if(!Storage::open(path, flags)) return false;
+        insertedZeroes.store(flags & 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * @brief Writes the tree to a compact Snapshot at @p path, which only holds the nodes, using up to
+     * @p threads threads; 0 means one per hardware thread. No thread may insert meanwhile.
+     * @return Whether the snapshot was written.
+     */
+    bool saveCompact(const char* path, size_t threads = 0) const {
+        return Storage::saveCompact(path, insertedZeroes.load(std::memory_order_relaxed), threads);
+    }
+
+    /**
+     * @brief Loads the compact Snapshot at @p path, instead of init(), using up to @p threads threads. The
+     * Indices of the tree that was saved are valid in this tree.
+     * @return Whether the snapshot was loaded.
+     */
+    bool openCompact(const char* path, size_t threads = 0) {
+        uint64_t flags;
+        if(!Storage::openCompact(path, flags, threads)) return false;
+        insertedZeroes.store(flags & 1, std::memory_order_relaxed);
+        return true;
+    }
     void checkForInsertedZeroes(uint64_t& idxResult) {
         if(dtree_unlikely(idxResult == 0ULL)) {
             if(dtree_unlikely(!insertedZeroes.load(std::memory_order_relaxed))) {
@@ -1023,37 +1549,158 @@ public:
             if(REPORT) printBuffer("NOT Found", data, length, result);
             return INDEX::NotFound();
         }
-        if(REPORT) printBuffer("Found", data, length, result);
-        return Index(result, length);//findNode(result, length, isRoot);
+        if(REPORT) printBuffer("Found", data, length, result);
+        return Index(result, length);//findNode(result, length, isRoot);
+    }
+
+    /**
+     * @brief Deconstructs the specified data into the compression tree.
+     * Returns an @c Index that unique identifies the deconstructed vector.
+     * @param data The data with length @c length to insert.
+     * @param length Length of @c data in number of 32bit units, at most Index::MAX_LENGTH.
+     * @return Unique index that can be used to retrieve the data.
+     */
+    IndexInserted insert(uint32_t* data, uint32_t length, bool isRoot) {
+        assert(length <= INDEX::MAX_LENGTH);
+        uint64_t result = length == 0 ? 0 : deconstruct(data, length, isRoot);
+        checkForInsertedZeroes(result);
+        if(REPORT) printBuffer("Inserted", data, length, result);
+        assert(length > 0);
+        return IndexInserted(result, length);
+    }
+
+    /**
+     * @brief Deconstructs @p n vectors into the compression tree at once.
+     * The vectors are stored back to back in @p data, vector @c i having length @p lengths[i]. The hash
+     * table work of all vectors is interleaved: level by level, the nodes of all vectors are deduplicated
+     * and then inserted as one batch. A vector occurring more than once is reported as inserted only
+     * for its first occurrence, like a sequence of insert() calls would.
+     * @param data The vectors, back to back.
+     * @param lengths Length of each vector in number of 32bit units, each at most Index::MAX_LENGTH.
+     * @param n Number of vectors.
+     * @param out Array of @p n where the unique index of each vector is written.
+     */
+    void insertMany(const uint32_t* data, const uint32_t* lengths, size_t n, IndexInserted* out, bool isRoot) {
+        ScratchArena::Frame frame(ScratchArena::local());
+        size_t* offsets = frame.alloc<size_t>(n);
+        uint32_t* current = frame.alloc<uint32_t>(n);
+        size_t total = 0;
+        size_t maxPairs = 0;
+        for(size_t i = 0; i < n; ++i) {
+            assert(lengths[i] <= INDEX::MAX_LENGTH);
+            offsets[i] = total;
+            current[i] = lengths[i];
+            total += lengths[i];
+            if(lengths[i] > 2) maxPairs += lengths[i] / 2;
+        }
+        uint32_t* work = frame.alloc<uint32_t>(total);
+        memcpy(work, data, total * sizeof(uint32_t));
+
+        // The first level has the most pairs, so buffers sized for it fit every level
+        size_t maxTableSize = maxPairs ? 1ULL << (64 - __builtin_clzll(maxPairs * 2 - 1)) : 0;
+        uint64_t* unique = frame.alloc<uint64_t>(maxPairs);
+        uint32_t* slots = frame.alloc<uint32_t>(maxPairs);
+        uint32_t* ids = frame.alloc<uint32_t>(maxPairs);
+        uint32_t* table = frame.alloc<uint32_t>(maxTableSize);
+        for(;;) {
+            // Gather the pairs of this level of all vectors, deduplicated through a local hash table
+            size_t pairs = 0;
+            for(size_t i = 0; i < n; ++i) {
+                if(current[i] > 2) pairs += current[i] / 2;
+            }
+            if(pairs == 0) break;
+            size_t tableMask = (1ULL << (64 - __builtin_clzll(pairs * 2 - 1))) - 1;
+            std::fill(table, table + tableMask + 1, 0xFFFFFFFFU);
+            size_t uniques = 0;
+            size_t nSlots = 0;
+            for(size_t i = 0; i < n; ++i) {
+                if(current[i] <= 2) continue;
+                uint32_t* w = &work[offsets[i]];
+                for(uint32_t j = 0; j < current[i] / 2; ++j) {
+                    uint64_t key = (uint64_t)w[2 * j] | ((uint64_t)w[2 * j + 1] << 32);
+                    size_t e = HashMurmur64<uint64_t>().hash(key) & tableMask;
+                    while(table[e] != 0xFFFFFFFFU && unique[table[e]] != key) e = (e + 1) & tableMask;
+                    if(table[e] == 0xFFFFFFFFU) {
+                        table[e] = uniques;
+                        unique[uniques++] = key;
+                    }
+                    slots[nSlots++] = table[e];
+                }
+            }
+
+            this->storage_fop_batch(unique, ids, uniques);
+
+            // Replace each pair by its ID, carrying an odd last element to the next level
+            size_t slot = 0;
+            for(size_t i = 0; i < n; ++i) {
+                if(current[i] <= 2) continue;
+                uint32_t* w = &work[offsets[i]];
+                uint32_t half = current[i] / 2;
+                for(uint32_t j = 0; j < half; ++j) {
+                    w[j] = ids[slots[slot++]];
+                }
+                if(current[i] & 0x1) {
+                    w[half] = w[half * 2];
+                    current[i] = half + 1;
+                } else {
+                    current[i] = half;
+                }
+            }
+        }
+
+        for(size_t i = 0; i < n; ++i) {
+            uint32_t* w = &work[offsets[i]];
+            uint64_t result;
+            if(lengths[i] == 0) {
+                result = 0;
+            } else if(dtree_unlikely(lengths[i] == 1)) {
+                result = *w;
+            } else {
+                result = deconstruct((uint64_t)w[0] | (((uint64_t)w[1]) << 32), 0, lengths[i], isRoot);
+            }
+            checkForInsertedZeroes(result);
+            if(REPORT) printBuffer("Inserted", (uint32_t*)data + offsets[i], lengths[i], result);
+            out[i] = IndexInserted(result, lengths[i]);
+        }
     }
 
     /**
-     * @brief Deconstructs the specified data into the compression tree.
-     * Returns an @c Index that unique identifies the deconstructed vector.
+     * @brief Deconstructs the specified vector of bytes into the compression tree. The last 32-bit unit is
+     * padded with zeroes internally, so @p data does not need to be padded or copied. The length in bytes is
+     * kept in the Index, for getBytes().
      * @param data The data with length @c length to insert.
-     * @param length Length of @c data in number of 32bit units.
+     * @param length Length of @c data in bytes, at most 4 * Index::MAX_LENGTH.
      * @return Unique index that can be used to retrieve the data.
      */
-    IndexInserted insert(uint32_t* data, uint32_t length, bool isRoot) {
-        uint64_t result = length == 0 ? 0 : deconstruct(data, length, isRoot);
-        checkForInsertedZeroes(result);
-        if(REPORT) printBuffer("Inserted", data, length, result);
+    IndexInserted insertBytes(const uint8_t* data, uint32_t length, bool isRoot) {
         assert(length > 0);
-        return IndexInserted(result, length);
+        assert((length + 3ULL) / 4 <= INDEX::MAX_LENGTH);
+        uint64_t result = deconstructBytes(data, length, isRoot);
+        checkForInsertedZeroes(result);
+        return withTailBytes(IndexInserted(result, (length + 3) / 4), length);
     }
 
     /**
-     * @brief Deconstructs the specified vector into the compression tree.
-     * Returns an @c Index that unique identifies the deconstructed vector.
-     * @param data The data with length @c length to insert.
-     * @param length Length of @c data in bytes.
+     * @brief Deconstructs the vector made of the @p n fragments in @p fragments, back to back, into the
+     * compression tree, without concatenating them first. The leaves are deconstructed straight from the
+     * fragments; only a pair of units that spans two fragments is assembled. The resulting Index is the
+     * same as that of insert() of the concatenated vector.
+     * @param fragments The fragments of the vector, lengths in number of 32bit units, together at most
+     * Index::MAX_LENGTH.
+     * @param n Number of fragments.
      * @return Unique index that can be used to retrieve the data.
      */
-//    Index insertBytes(uint8_t* data, uint32_t length) {
-//        uint64_t result = (uint64_t)deconstructBytes(data, length, true);
-//        if(REPORT) printBuffer("Inserted", (char*)data, length, result);
-//        return Index(result);
-//    }
+    IndexInserted insertFragments(const Fragment* fragments, size_t n, bool isRoot) {
+        size_t length = 0;
+        for(size_t f = 0; f < n; ++f) {
+            length += fragments[f].getLength();
+        }
+        assert(length > 0);
+        assert(length <= INDEX::MAX_LENGTH);
+        uint64_t result = deconstructFragments(fragments, n, length, isRoot);
+        checkForInsertedZeroes(result);
+        return IndexInserted(result, length);
+    }
 
     /**
      * @brief Constructs the entire vector using the specified Index. Make sure the length of the vector
@@ -1091,6 +1738,12 @@ public:
     bool get(Index idx, uint32_t* buffer, bool isRoot) {
         if(idx.getLength() == 0) return true;
 
+        // A vector of one unit is not stored: its ID is the unit itself
+        if(idx.getLength() == 1) {
+            *buffer = idx.getID();
+            return true;
+        }
+
         DTreeRootNode root = getRootNode(idx, isRoot);
 
         if(REPORT) printf("get(%zx, %zu, %u)\n", root.getNode().getData(), root.getLength(), isRoot);
@@ -1127,6 +1780,44 @@ public:
         return true;
     }
 
+    /**
+     * @brief Constructs the entire vector of bytes using the specified Index, which writes exactly the length
+     * in bytes of the vector to @p buffer, without padding.
+     * @param idx Index of the vector to construct.
+     * @param buffer Buffer where the vector will be stored. Needs to be at least idx.getLengthInBytes() long.
+     */
+    bool getBytes(Index idx, uint8_t* buffer, bool isRoot) {
+        uint32_t tail = idx.getTailBytes();
+        if(!tail) return get(idx, (uint32_t*)buffer, isRoot);
+        uint32_t length = idx.getLength();
+        uint32_t last;
+        if(length > 1) {
+            getPartial(idx, 0, length - 1, (uint32_t*)buffer, isRoot);
+        }
+        getPartial(idx, length - 1, 1, &last, isRoot);
+        memcpy(buffer + (length - 1) * sizeof(uint32_t), &last, tail);
+        return true;
+    }
+
+    /**
+     * @brief Constructs the vector using the specified Index, scattering it over the @p n fragments in
+     * @p fragments, back to back. Each fragment is constructed partially, directly in its own buffer.
+     * @param idx Index of the vector to construct.
+     * @param fragments The fragments to write to. Their lengths in total need to be at most idx.getLength().
+     * @param n Number of fragments.
+     */
+    bool getFragments(Index idx, const Fragment* fragments, size_t n, bool isRoot) {
+        uint32_t offset = 0;
+        for(size_t f = 0; f < n; ++f) {
+            uint32_t length = fragments[f].getLength();
+            if(length == 0) continue;
+            assert(offset + length <= idx.getLength());
+            getPartial(idx, offset, length, fragments[f].getData(), isRoot);
+            offset += length;
+        }
+        return true;
+    }
+
     /**
      * @brief Partially constructs a vector using the specified Index. Make sure the length of the vector
      * is a multiple of 4 bytes, otherwise use @c getBytes().
@@ -1176,9 +1867,10 @@ public:
         uint64_t result = deltaSparseApply(idx.getID(), length, 0, deltaData, offsets, offset, isRoot);
         checkForInsertedZeroes(result);
 
-        IndexInserted R(result, length);
+        IndexInserted R = withTailBytesOf(IndexInserted(result, length), idx);
         if(REPORT) {
-            uint32_t buffer[R.getState().getLength()];
+            ScratchArena::Frame frame(ScratchArena::local());
+            uint32_t* buffer = frame.alloc<uint32_t>(R.getState().getLength());
             get(R.getState(), buffer, isRoot);
             printBuffer("Inserted", buffer, idx.getLength(), result);
         }
@@ -1191,12 +1883,13 @@ public:
         uint64_t result = deltaSparseApply(idx.getID(), length, 0, deltaData, offsets, offset, stride, isRoot);
         checkForInsertedZeroes(result);
         if(REPORT) {
-            uint32_t buffer[length];
+            ScratchArena::Frame frame(ScratchArena::local());
+            uint32_t* buffer = frame.alloc<uint32_t>(length);
             get(result, buffer, isRoot);
             printBuffer("Inserted", buffer, length, result);
         }
         assert(length > 0 && "length is 0");
-        return IndexInserted(result, length);
+        return withTailBytesOf(IndexInserted(result, length), idx);
     }
 
     /**
@@ -1220,23 +1913,30 @@ public:
      * @param offset The offset within the vector at which the delta will be applied, in 32-bit units.
      * @param deltaData The contents of the delta.
      * @param deltaLength The length of the delta, in 32-bit units
-     * @return A new unique index that can be used to retrieve the new vector.
+     * @return A new unique index that can be used to retrieve the new vector, with the tail bytes of @c idx.
      */
     IndexInserted delta(Index idx, uint32_t offset, const uint32_t* deltaData, uint32_t deltaLength, bool isRoot) {
 
+        // A vector of one unit is not stored: its ID is the unit itself
+        if(idx.getLength() == 1) {
+            assert(offset == 0 && deltaLength == 1);
+            return withTailBytesOf(IndexInserted(*deltaData, 1), idx);
+        }
+
         DTreeRootNode root = getRootNode(idx, isRoot);
 
         uint64_t result = deltaApplyMapped(root.getNode(), root.getLength(), offset, deltaLength, deltaData, isRoot);
         if(root.getNode().getData() == result) {
-            result = idx;
+            result = idx.getID();
         } else {
             uint32_t level = lengthToLevel(root.getLength());
             result = deconstruct(result, level, root.getLength(), isRoot);
         }
         checkForInsertedZeroes(result);
-        IndexInserted R(result, root.getLength());
+        IndexInserted R = withTailBytesOf(IndexInserted(result, root.getLength()), idx);
         if(REPORT) {
-            uint32_t buffer[R.getState().getLength()];
+            ScratchArena::Frame frame(ScratchArena::local());
+            uint32_t* buffer = frame.alloc<uint32_t>(R.getState().getLength());
             get(R.getState(), buffer, isRoot);
             printBuffer("Inserted", buffer, idx.getLength(), result);
         }
@@ -1245,7 +1945,34 @@ public:
     }
 
     IndexInserted delta(Index idx, MultiProjection& projection, bool isRoot, uint32_t* buffer) {
-        return multiDelta(idx, isRoot, projection, 0, 0, projection.getProjections(), buffer);
+        return withTailBytesOf(multiDelta(idx, isRoot, projection, 0, 0, projection.getProjections(), buffer), idx);
+    }
+
+    /**
+     * @brief Like delta(), with an offset and length in bytes. The delta MUST be within the original vector.
+     * A delta that starts and ends on 32-bit units is applied directly from @p deltaData, otherwise only the
+     * units it touches are assembled first.
+     * @requires offset + deltaLength <= idx.getLengthInBytes()
+     * @return A new unique index with the length in bytes of @p idx.
+     */
+    IndexInserted deltaBytes(Index idx, uint32_t offset, const uint8_t* deltaData, uint32_t deltaLength, bool isRoot) {
+        assert(offset + deltaLength <= idx.getLengthInBytes());
+        if(!deltaLength) return IndexInserted(idx, false);
+        if(((offset | deltaLength) & 0x3) == 0) {
+            return delta(idx, offset / 4, (const uint32_t*)deltaData, deltaLength / 4, isRoot);
+        }
+        uint32_t first = offset / 4;
+        uint32_t last = (offset + deltaLength - 1) / 4;
+        ScratchArena::Frame frame(ScratchArena::local());
+        uint32_t* units = frame.alloc<uint32_t>(last - first + 1);
+        if(offset & 0x3) {
+            getPartial(idx, first, 1, units, isRoot);
+        }
+        if(((offset + deltaLength) & 0x3) && (last > first || !(offset & 0x3))) {
+            getPartial(idx, last, 1, units + (last - first), isRoot);
+        }
+        memcpy((uint8_t*)units + (offset & 0x3), deltaData, deltaLength);
+        return delta(idx, first, units, last - first + 1, isRoot);
     }
 
 
@@ -1261,7 +1988,8 @@ public:
 
         auto projections = projection.getProjections();
 
-        uint64_t jump[projections];
+        ScratchArena::Frame frame(ScratchArena::local());
+        uint64_t* jump = frame.alloc<uint64_t>(projections);
         uint64_t jumps = 0;
 
         // Go through all projections to find the required data in the current tree
@@ -1345,6 +2073,7 @@ public:
         if constexpr(REPORT) printf("returning %zx\n", mapped);
         uint64_t result = deconstruct(mapped, 0, length, isRoot && level == 0);
         checkForInsertedZeroes(result);
+        if(level == 0) return withTailBytesOf(IndexInserted(result, length), idx);
         return IndexInserted(result, length);
     }
 
@@ -1368,12 +2097,13 @@ public:
         checkForInsertedZeroes(result);
         if(REPORT) {
             auto R = IndexInserted(result, newLength);
-            uint32_t buffer[newLength];
+            ScratchArena::Frame frame(ScratchArena::local());
+            uint32_t* buffer = frame.alloc<uint32_t>(newLength);
             get(R.getState().getData(), buffer, isRoot);
             printBuffer("Inserted", buffer, newLength, result);
         }
         assert(newLength > 0 && "length is 0");
-        return IndexInserted(result, newLength);
+        return withTailBytesOf(IndexInserted(result, newLength), idx);
     }
 
     /**
@@ -1439,12 +2169,13 @@ public:
         checkForInsertedZeroes(result);
         uint64_t newLength = length + (uint64_t)offset + (uint64_t)deltaLength;
         if(REPORT) {
-            uint32_t buffer[1 + newLength];
+            ScratchArena::Frame frame(ScratchArena::local());
+            uint32_t* buffer = frame.alloc<uint32_t>(1 + newLength);
             buffer[newLength] = 0;
             get(result, buffer, isRoot);
             printBuffer("Inserted", buffer, idx.getLength(), result);
         }
-        return IndexInserted(result, newLength);
+        return withTailBytesOf(IndexInserted(result, newLength), idx);
     }
 
     IndexInserted extend(Index idx, uint32_t extendWith, bool isRoot) {
@@ -1455,12 +2186,13 @@ public:
 //        checkForInsertedZeroes(result); // not needed because we can only get zeroes if we start with zeroes
         uint64_t newLength = length + (uint64_t)extendWith;
         if(REPORT) {
-            uint32_t buffer[1 + newLength];
+            ScratchArena::Frame frame(ScratchArena::local());
+            uint32_t* buffer = frame.alloc<uint32_t>(1 + newLength);
             buffer[newLength] = 0;
             get(result, buffer, isRoot);
             printBuffer("Inserted", buffer, idx.getLength(), result);
         }
-        return IndexInserted(result, newLength);
+        return withTailBytesOf(IndexInserted(result, newLength), idx);
     }
 
     /**
@@ -1621,6 +2353,19 @@ private:
         return mapped;
     }
 
+    /**
+     * @brief Constructs the @p n independent non-root nodes in @p idx at once into @p out. Storage prefetches
+     * them as a batch, so expanding a level costs about one memory stall instead of one per node. @p out
+     * may be @p idx itself: a level of IDs is expanded in place into nodes.
+     */
+    __attribute__((always_inline))
+    void construct(const uint32_t* idx, uint64_t* out, uint32_t n) {
+        this->storage_get_batch(idx, out, n);
+        if(REPORT) {
+            for(uint32_t i = n; i--;) printf("Got (batch) -> %16zx\n", out[i]);
+        }
+    }
+
     __attribute__((always_inline))
     uint64_t construct(uint64_t idx, uint32_t level, bool isRoot = false) {
 //        if(idx == 0) return 0;
@@ -1674,6 +2419,18 @@ private:
 //
 //    7: 4 + 3
 //    6
+    /**
+     * @brief Deconstructs the @p n independent nodes in @p v at once, writing the IDs to @p out.
+     * Storage resolves them as a batch, so their memory stalls overlap. @p out may be @p v itself.
+     */
+    __attribute__((always_inline))
+    void deconstruct(const uint64_t* v, uint32_t* out, uint32_t n) {
+        this->storage_fop_batch(v, out, n);
+        if(REPORT) {
+            for(uint32_t i = 0; i < n; ++i) printf("Dec %8x(%u) <- (batch)\n", out[i], 8);
+        }
+    }
+
 //    45
 //
 //    171: 128 + 43
@@ -1698,9 +2455,7 @@ private:
             //  |   /    /  /-----------/
             // [ ] [ ] [i] [ ]
             // data
-            for(uint32_t i = 0; i < currentLengthDiv2; ++i) {
-                data[i] = deconstruct(dataSource[i], 0);
-            }
+            deconstruct(dataSource, data, currentLengthDiv2);
 
             // dataSource
             // <--------- currentLength --------->
@@ -1730,12 +2485,10 @@ private:
         }
 
 
-        uint32_t level = lengthToLevel(length);
         uint32_t lengthDiv2 = length / 2;
-        uint32_t buffer[lengthDiv2 + 1];
-        for (uint32_t i = 0; i < lengthDiv2; ++i) {
-            buffer[i] = deconstruct(((uint64_t *)data)[i], level);
-        }
+        ScratchArena::Frame frame(ScratchArena::local());
+        uint32_t* buffer = frame.alloc<uint32_t>(lengthDiv2 + 1);
+        deconstruct((const uint64_t*)data, buffer, lengthDiv2);
         if(length & 0x1) {
             buffer[lengthDiv2] = data[lengthDiv2 * 2];
             deconstructInline(buffer, lengthDiv2 + 1, isRoot);
@@ -1796,20 +2549,102 @@ private:
 //        return deconstruct(((uint64_t)r) << 32 | (uint64_t)l, level, isRoot);
 //    }
 
-//    uint64_t deconstructBytes(uint8_t* data, uint32_t length) {
-//        if(length <= 4) {
-//            uint32_t d;
-//            memmove(&d, data, length);
-//            return d;
-//        } else if(length <= 8) {
-//            return deconstruct(*(uint64_t*)data, 0);
-//        }
-//        uint32_t level = lengthToLevel(length);
-//        uint32_t leftLength = 1 << level;
-//        uint32_t l = deconstructBytes(data, leftLength);
-//        uint32_t r = deconstructBytes(data+leftLength, length-leftLength);
-//        return deconstruct(((uint64_t)r) << 32 | (uint64_t)l, level - 2);
-//    }
+    /**
+     * @brief Like deconstruct(data, length, isRoot) for a vector of @p bytes bytes. Only the last pair of
+     * units is assembled on the stack, padded with zeroes.
+     */
+    uint64_t deconstructBytes(const uint8_t* data, uint32_t bytes, bool isRoot) {
+        uint32_t length = (bytes + 3) / 4;
+        if(length <= 2) {
+            uint64_t v = 0;
+            memcpy(&v, data, bytes);
+            return length == 1 ? v : deconstruct(v, 0, length, isRoot);
+        }
+
+        uint32_t lengthDiv2 = length / 2;
+        ScratchArena::Frame frame(ScratchArena::local());
+        uint32_t* buffer = frame.alloc<uint32_t>(lengthDiv2 + 1);
+        uint32_t pairs = bytes / 8;
+        deconstruct((const uint64_t*)data, buffer, pairs);
+        if(uint32_t rest = bytes - pairs * 8) {
+            uint64_t tail = 0;
+            memcpy(&tail, data + pairs * 8, rest);
+            if(pairs < lengthDiv2) {
+                deconstruct(&tail, buffer + pairs, 1);
+            } else {
+                buffer[lengthDiv2] = tail;
+            }
+        }
+        deconstructInline(buffer, lengthDiv2 + (length & 0x1), isRoot);
+        return deconstruct((uint64_t)buffer[0] | (((uint64_t)buffer[1]) << 32), 0, length, isRoot);
+    }
+
+    /**
+     * @brief Like deconstruct(data, length, isRoot) for a vector of @p length units in @p n fragments.
+     * Pairs within a fragment are deconstructed as one batch per fragment, a pair spanning two fragments
+     * on its own.
+     */
+    uint64_t deconstructFragments(const Fragment* fragments, size_t n, uint32_t length, bool isRoot) {
+        if(length <= 2) {
+            uint32_t v[2] = {0, 0};
+            uint32_t* d = v;
+            for(size_t f = 0; f < n; ++f) {
+                memcpy(d, fragments[f].getData(), fragments[f].getLength() * sizeof(uint32_t));
+                d += fragments[f].getLength();
+            }
+            return length == 1 ? v[0] : deconstruct((uint64_t)v[0] | (((uint64_t)v[1]) << 32), 0, length, isRoot);
+        }
+
+        uint32_t lengthDiv2 = length / 2;
+        ScratchArena::Frame frame(ScratchArena::local());
+        uint32_t* buffer = frame.alloc<uint32_t>(lengthDiv2 + 1);
+        uint32_t pairs = 0;
+        bool carry = false;
+        uint32_t carried = 0;
+        for(size_t f = 0; f < n; ++f) {
+            const uint32_t* data = fragments[f].getData();
+            uint32_t fragmentLength = fragments[f].getLength();
+            if(!fragmentLength) continue;
+            if(carry) {
+                uint64_t v = (uint64_t)carried | (((uint64_t)*data) << 32);
+                deconstruct(&v, buffer + pairs, 1);
+                pairs++;
+                data++;
+                fragmentLength--;
+            }
+            uint32_t fragmentPairs = fragmentLength / 2;
+            deconstruct((const uint64_t*)data, buffer + pairs, fragmentPairs);
+            pairs += fragmentPairs;
+            carry = fragmentLength & 0x1;
+            if(carry) carried = data[fragmentLength - 1];
+        }
+        assert(pairs == lengthDiv2);
+        if(carry) {
+            buffer[lengthDiv2] = carried;
+        }
+        deconstructInline(buffer, lengthDiv2 + (length & 0x1), isRoot);
+        return deconstruct((uint64_t)buffer[0] | (((uint64_t)buffer[1]) << 32), 0, length, isRoot);
+    }
+
+    /**
+     * @brief Sets the tail bytes of the Index of @p r to those of a vector of @p bytes bytes.
+     */
+    static IndexInserted withTailBytes(IndexInserted r, uint64_t bytes) {
+        Index idx = r.getState();
+        idx.setTailBytes(bytes & 0x3);
+        return IndexInserted(idx, r.isInserted());
+    }
+
+    /**
+     * @brief Gives the Index of @p r the tail bytes of @p base if it kept the length of @p base. A vector
+     * that grew ends in whole units, so it keeps no tail bytes.
+     */
+    static IndexInserted withTailBytesOf(IndexInserted r, Index base) {
+        if(r.getState().getLength() != base.getLength()) return r;
+        Index idx = r.getState();
+        idx.setTailBytes(base.getTailBytes());
+        return IndexInserted(idx, r.isInserted());
+    }
 
     uint64_t findRecursing(uint32_t* data, uint32_t length, bool isRoot) {
         if(length == 1) {
@@ -1853,9 +2688,7 @@ private:
         bufferDest[0] = construct(idx, length, isRoot);
 
         for(uint32_t levelLength = 2; levelLength < length; levelLength <<=1) {
-            for(uint32_t i = levelLength; i--;) {
-                bufferDest[i] = construct(buffer[i], false);
-            }
+            construct(buffer, bufferDest, levelLength);
         }
     }
 
@@ -1866,9 +2699,7 @@ private:
 
         bufferDest[0] = mapped;
         for(uint32_t levelLength = 2; levelLength < length; levelLength <<=1) {
-            for(uint32_t i = levelLength; i--;) {
-                bufferDest[i] = construct(buffer[i], false);
-            }
+            construct(buffer, bufferDest, levelLength);
         }
     }
 
@@ -1876,33 +2707,39 @@ private:
         uint64_t* bufferDest = (uint64_t*)buffer;
 
         for(uint32_t levelLength = 2; levelLength < length; levelLength <<=1) {
-            for(uint32_t i = levelLength; i--;) {
-                bufferDest[i] = construct(buffer[i], false);
-            }
+            construct(buffer, bufferDest, levelLength);
         }
     }
 
-    // TODO: do the same as the new deconstruct()
+    /**
+     * @brief Constructs the vector of @p length units at @p idx into @p buffer. The balanced left children
+     * along the right spine of the tree are constructed level by level, the spine itself in a loop.
+     */
     void construct(uint64_t idx, uint32_t length, uint32_t* buffer, bool isRoot) {
-        if(REPORT) printf("construct(%zx, %u, %u)\n", idx, length, isRoot);
-        if(length == 1) {
-            if(REPORT) printf("Got %8zx(%u) -> %16zx\n", idx, length * 4, idx);
-            *buffer = idx;
-            return;
-        }
-        uint64_t mapped = construct(idx, length, isRoot);
+        for(;;) {
+            if(REPORT) printf("construct(%zx, %u, %u)\n", idx, length, isRoot);
+            if(length == 1) {
+                if(REPORT) printf("Got %8zx(%u) -> %16zx\n", idx, length * 4, idx);
+                *buffer = idx;
+                return;
+            }
+            uint64_t mapped = construct(idx, length, isRoot);
 
-        if(idx == 0) {
-            memset(buffer, 0, length * sizeof(uint32_t));
-            return;
-        }
+            if(idx == 0) {
+                memset(buffer, 0, length * sizeof(uint32_t));
+                return;
+            }
 
-        uint32_t maxPowerTwoInLength = 1U << (31 - __builtin_clz(length));
-        if(maxPowerTwoInLength == length) {
-            constructP2(idx, length, buffer, isRoot);
-        } else {
+            uint32_t maxPowerTwoInLength = 1U << (31 - __builtin_clz(length));
+            if(maxPowerTwoInLength == length) {
+                constructP2(idx, length, buffer, isRoot);
+                return;
+            }
             constructP2(mapped & 0xFFFFFFFFULL, maxPowerTwoInLength, buffer, false);
-            construct(mapped >> 32ULL, length-maxPowerTwoInLength, buffer + maxPowerTwoInLength, false);
+            idx = mapped >> 32ULL;
+            length -= maxPowerTwoInLength;
+            buffer += maxPowerTwoInLength;
+            isRoot = false;
         }
     }
 
@@ -1964,11 +2801,63 @@ private:
 //        }
 //    }
 
+    /**
+     * @brief Constructs @p wantedLength units at @p offset of the vector of @p length units at @p idx into
+     * @p buffer. Walks down the tree in a loop; when the wanted part spans both children of a node, the right
+     * part is put aside until the left part is constructed.
+     */
     void constructPartial(uint64_t idx, uint64_t length, uint32_t offset, uint32_t wantedLength, uint32_t* buffer, bool isRoot) {
-        if(REPORT) {
-//            for(int i=__builtin_clz(1 << lengthToLevel(length))-26; i--;) printf("    ");
-            printf("\033[35mconstructPartial\033[0m(%zx, %zu, %u, %u, %u)\n", idx, length, offset, wantedLength, isRoot);
+        struct Part {
+            uint64_t idx;
+            uint64_t length;
+            uint32_t wantedLength;
+            uint32_t* buffer;
+        };
+        Part pending[MAX_DEPTH];
+        uint32_t pendingParts = 0;
+
+        for(;;) {
+            if(REPORT) {
+                printf("\033[35mconstructPartial\033[0m(%zx, %zu, %u, %u, %u)\n", idx, length, offset, wantedLength, isRoot);
+            }
+            if(length <= 2 || idx == 0) {
+                constructPartialLeaf(idx, length, offset, wantedLength, buffer, isRoot);
+                if(!pendingParts) return;
+                Part const& part = pending[--pendingParts];
+                idx = part.idx;
+                length = part.length;
+                offset = 0;
+                wantedLength = part.wantedLength;
+                buffer = part.buffer;
+                isRoot = false;
+                continue;
+            }
+
+            uint32_t level = lengthToLevel(length);
+            uint64_t mapped = construct(idx, level, length, isRoot);
+            if(REPORT) printf("Got %8zx(%zu) -> %16zx (%u)\n", idx, length, mapped, isRoot);
+
+            uint32_t leftLength = 1 << level;
+            isRoot = false;
+
+            if(offset < leftLength) {
+                uint32_t leftWantedLength = leftLength - offset;
+                if(wantedLength > leftWantedLength) {
+                    assert(pendingParts < MAX_DEPTH);
+                    pending[pendingParts++] = Part{mapped >> 32ULL, length-leftLength, wantedLength - leftWantedLength, buffer + leftWantedLength};
+                    wantedLength = leftWantedLength;
+                }
+                idx = mapped & 0xFFFFFFFFULL;
+                length = leftLength;
+            } else {
+                idx = mapped >> 32ULL;
+                length = length-leftLength;
+                offset = offset - leftLength;
+            }
         }
+    }
+
+    void constructPartialLeaf(uint64_t idx, uint64_t length, uint32_t offset, uint32_t wantedLength, uint32_t* buffer, bool isRoot) {
         if(length == 1) {
             if(REPORT) printf("Got %8zx(%zu) -> %16zx (%u)\n", idx, length, idx, isRoot);
             *buffer = idx;
@@ -1980,40 +2869,16 @@ private:
             return;
         }
 
-        if(length == 2) {
-            uint64_t mapped = construct(idx, 0, length, isRoot);
-            if(wantedLength == 2) {
-                *(uint64_t*)buffer = mapped;
-            } else {
-                if(offset == 0) {
-                    *buffer = (uint32_t)mapped;
-                } else {
-                    *buffer = mapped >> 32ULL;
-                }
-            }
-            return;
-        }
-
-        uint32_t level = lengthToLevel(length);
-        uint64_t mapped = construct(idx, level, length, isRoot);
-        if(REPORT) printf("Got %8zx(%zu) -> %16zx (%u)\n", idx, length, mapped, isRoot);
-
-        uint32_t leftLength = 1 << level;
-
-        if(offset < leftLength) {
-//            if(offset + wantedLength < leftLength) {
-//            }
-            uint32_t leftWantedLength = leftLength - offset;
-            if(wantedLength > leftWantedLength) {
-                constructPartial(mapped & 0xFFFFFFFFULL, leftLength, offset, leftWantedLength, buffer, false);
-                constructPartial(mapped >> 32ULL, length-leftLength, 0, wantedLength - leftWantedLength, buffer + leftWantedLength, false);
+        uint64_t mapped = construct(idx, 0, length, isRoot);
+        if(wantedLength == 2) {
+            *(uint64_t*)buffer = mapped;
+        } else {
+            if(offset == 0) {
+                *buffer = (uint32_t)mapped;
             } else {
-                constructPartial(mapped & 0xFFFFFFFFULL, leftLength, offset, wantedLength, buffer, false);
+                *buffer = mapped >> 32ULL;
             }
-        } else {
-            constructPartial(mapped >> 32ULL, length-leftLength, offset - leftLength, wantedLength, buffer, false);
         }
-
     }
 
     void constructSparseUnits(uint64_t idx, uint64_t length, uint32_t internalOffset, uint32_t* buffer, uint32_t offsets, uint32_t* offset, bool isRoot) {
@@ -2338,65 +3203,124 @@ private:
         return deconstruct(leftIndex | rightIndex, level, length, isRoot);
     }
 
+    /**
+     * @brief Applies the delta of @p deltaLength units at @p offset to the vector of @p length units at @p idx.
+     * Walks down the tree in a loop, keeping the path in a work list. A node whose children both change is
+     * revisited for its right child after its left child is done.
+     * @return The ID of the changed vector, which is @p idx if nothing changed.
+     */
     uint64_t deltaApply(uint64_t idx, uint64_t length, uint32_t offset, uint32_t deltaLength, const uint32_t* data, bool isRoot) {
-        assert(length > 0);
-
-        if(REPORT) {
-//            for(int i=__builtin_clz(1 << lengthToLevel(length))-26; i--;) printf("    ");
-            printf("deltaApply(%zx, %zuB, %uB, %uB, %p)\n", idx, length << 2, offset << 2, deltaLength << 2, data);
-        }
+        enum class Step: uint8_t {
+            ENTER,
+            LEFT_DONE,
+            RIGHT_DONE,
+        };
+        struct Frame {
+            uint64_t idx;
+            uint64_t length;
+            uint32_t offset;
+            uint32_t deltaLength;
+            const uint32_t* data;
+            bool isRoot;
+            Step step;
+            uint32_t level;
+            uint32_t leftDeltaLength;
+            DTreeNode node;
+            uint64_t mappedNew;
+        };
+        Frame path[MAX_DEPTH];
+        uint32_t depth = 0;
+        uint64_t result = 0;
+
+        auto push = [&](uint64_t idx, uint64_t length, uint32_t offset, uint32_t deltaLength, const uint32_t* data) {
+            assert(depth + 1 < MAX_DEPTH);
+            Frame& child = path[++depth];
+            child.idx = idx;
+            child.length = length;
+            child.offset = offset;
+            child.deltaLength = deltaLength;
+            child.data = data;
+            child.isRoot = false;
+            child.step = Step::ENTER;
+        };
 
-        if(length == 1) {
-            if(REPORT) printf("Got %8zx(%zu) -> %16zx\n", idx, length, idx);
-            assert(offset == 0);
-            assert(deltaLength >= 0);
-            return *data;
-        }
+        path[0].idx = idx;
+        path[0].length = length;
+        path[0].offset = offset;
+        path[0].deltaLength = deltaLength;
+        path[0].data = data;
+        path[0].isRoot = isRoot;
+        path[0].step = Step::ENTER;
 
-        DTreeNode node = construct(idx, 0, length, isRoot);
+        for(;;) {
+            Frame& f = path[depth];
+            if(f.step == Step::ENTER) {
+                assert(f.length > 0);
 
-        if(length == 2) {
+                if(REPORT) {
+                    printf("deltaApply(%zx, %zuB, %uB, %uB, %p)\n", f.idx, f.length << 2, f.offset << 2, f.deltaLength << 2, f.data);
+                }
 
-            // This is >= instead of == because in some edge cases deltaApply() may be called with a
-            // deltaLength larger than the length, in which case only length bytes should be copied.
-            if (deltaLength >= 2) {
-                return deconstruct(*(uint64_t*)data, 0, length, isRoot);
-            } else {
-                if(offset == 0) {
-                    node.setLeft(*data);
+                if(f.length == 1) {
+                    if(REPORT) printf("Got %8zx(%zu) -> %16zx\n", f.idx, f.length, f.idx);
+                    assert(f.offset == 0);
+                    result = *f.data;
                 } else {
-                    node.setRight(*data);
-                }
-                return deconstruct(node.getData(), 0, length, isRoot);
-            }
-        }
+                    f.node = DTreeNode(construct(f.idx, 0, f.length, f.isRoot));
 
-        uint32_t level = lengthToLevel(length);
+                    if(f.length == 2) {
 
-        uint32_t leftLength = 1 << level;
-        uint64_t mappedNew = 0;
+                        // This is >= instead of == because in some edge cases deltaApply() may be called with a
+                        // deltaLength larger than the length, in which case only length bytes should be copied.
+                        if (f.deltaLength >= 2) {
+                            result = deconstruct(*(uint64_t*)f.data, 0, f.length, f.isRoot);
+                        } else {
+                            if(f.offset == 0) {
+                                f.node.setLeft(*f.data);
+                            } else {
+                                f.node.setRight(*f.data);
+                            }
+                            result = deconstruct(f.node.getData(), 0, f.length, f.isRoot);
+                        }
+                    } else {
+                        f.level = lengthToLevel(f.length);
+                        uint32_t leftLength = 1 << f.level;
 
-        if(offset < leftLength) {
-            uint32_t leftDeltaLength = leftLength - offset;
-            if(leftDeltaLength < deltaLength) {
-                mappedNew = (deltaApply(node.getLeft(), leftLength, offset, leftDeltaLength, data, false) & 0xFFFFFFFFULL)
-                          | ((deltaApply(node.getRight(), length-leftLength, 0, deltaLength - leftDeltaLength, data + leftDeltaLength, false)) << 32)
-                          ;
+                        if(f.offset < leftLength) {
+                            f.leftDeltaLength = leftLength - f.offset;
+                            f.step = Step::LEFT_DONE;
+                            push(f.node.getLeft(), leftLength, f.offset, std::min(f.leftDeltaLength, f.deltaLength), f.data);
+                        } else {
+                            f.mappedNew = f.node.getLeftPart();
+                            f.step = Step::RIGHT_DONE;
+                            push(f.node.getRight(), f.length-leftLength, f.offset - leftLength, f.deltaLength, f.data);
+                        }
+                        continue;
+                    }
+                }
             } else {
-//                *((uint32_t*)(mapped)) = deltaApply(mapped & 0xFFFFFFFFULL, leftLength, offset, leftDeltaLength, data);
-                mappedNew = deltaApply(node.getLeft(), leftLength, offset, deltaLength, data, false) & 0xFFFFFFFFULL;
-                mappedNew |= node.getRightPart();
+                if(f.step == Step::LEFT_DONE) {
+                    f.mappedNew = result & 0xFFFFFFFFULL;
+                    if(f.leftDeltaLength < f.deltaLength) {
+                        uint32_t leftLength = 1 << f.level;
+                        f.step = Step::RIGHT_DONE;
+                        push(f.node.getRight(), f.length-leftLength, 0, f.deltaLength - f.leftDeltaLength, f.data + f.leftDeltaLength);
+                        continue;
+                    }
+                    f.mappedNew |= f.node.getRightPart();
+                } else {
+                    f.mappedNew |= result << 32;
+                }
+
+                if(f.node.getData() == f.mappedNew) {
+                    result = f.idx;
+                } else {
+                    result = deconstruct(f.mappedNew, f.level, f.length, f.isRoot);
+                }
             }
-        } else {
-//            *((uint32_t*)(mapped)+1) = deltaApply(mapped >> 32ULL, length-leftLength, offset - leftLength, deltaLength, data);
-            mappedNew = deltaApply(node.getRight(), length-leftLength, offset - leftLength, deltaLength, data, false) << 32;
-            mappedNew |= node.getLeftPart();
-        }
 
-        if(node.getData() == mappedNew) {
-            return idx;
-        } else {
-            return deconstruct(mappedNew, level, length, isRoot);
+            if(!depth) return result;
+            --depth;
         }
     }
 
@@ -2531,53 +3455,111 @@ private:
 
 
     // TODO: limit to 5 parameters to avoid passing arguments on the stack
+    /**
+     * @brief Extends the vector of @p length units at @p idx with @p offset zeroes and the @p deltaLength units
+     * at @p data. Walks down the tree in a loop while only one child needs to be extended, keeping the path in
+     * a work list, and then joins the children back up the path.
+     */
     uint64_t extendRecursive(uint64_t idx, uint64_t length, uint32_t offset, int32_t deltaLength, const uint32_t* data, bool isRoot, bool toRoot) {
-        uint64_t newLength = length + (uint64_t)offset + (uint64_t)deltaLength;
-
-        if(REPORT) printf("Extending %zx(%zu) at %u with ...(%u)\n", idx, length << 2, offset << 2, deltaLength << 2);
+        struct Frame {
+            uint64_t newLength;
+            uint32_t level;
+            bool toRoot;
+
+            // Whether the left child is unchanged, otherwise the right child is new and deconstructed from
+            // rightData after the left child is extended
+            bool leftUnchanged;
+            uint32_t leftIndex;
+            const uint32_t* rightData;
+            uint64_t rightLength;
+        };
+        Frame path[MAX_DEPTH];
+        uint32_t depth = 0;
+        uint64_t result;
 
-        if(newLength == 1) {
-            return *data;
-        }
-        if(newLength == 2) {
+        for(;;) {
+            uint64_t newLength = length + (uint64_t)offset + (uint64_t)deltaLength;
 
-            // This can only happen for [original][delta]
-            return deconstruct( ((uint64_t)idx) | (((uint64_t)(*(uint32_t*)data)) << 32), 0, newLength, toRoot);
+            if(REPORT) printf("Extending %zx(%zu) at %u with ...(%u)\n", idx, length << 2, offset << 2, deltaLength << 2);
 
-        }
+            if(newLength == 1) {
+                result = *data;
+                break;
+            }
+            if(newLength == 2) {
 
-        uint32_t level = lengthToLevel(newLength);
-        uint32_t leftLength = 1 << level;
-        uint32_t zeroExtendedLength = length + offset;
-        uint32_t rightOffset = zeroExtendedLength - leftLength;
+                // This can only happen for [original][delta]
+                result = deconstruct( ((uint64_t)idx) | (((uint64_t)(*(uint32_t*)data)) << 32), 0, newLength, toRoot);
+                break;
+            }
 
-        uint32_t leftIndex, rightIndex;
+            uint32_t level = lengthToLevel(newLength);
+            uint32_t leftLength = 1 << level;
+            uint32_t zeroExtendedLength = length + offset;
+            uint32_t rightOffset = zeroExtendedLength - leftLength;
 
-        // If the left part is exactly what we already have
-        if(leftLength == length) {
-            leftIndex = isRoot ? deconstruct(construct(idx, level, isRoot), level, length, false) : idx;
-            if(REPORT) printf("Detected identical part: %x(%u)\n", leftIndex, leftLength);
-            rightIndex = insertZeroPrepended(data, deltaLength, offset, false);
+            uint32_t leftIndex, rightIndex;
 
-        // If the left part is part of what we already have
-        } else if(leftLength < length) {
-            uint64_t mapped = construct(idx, level, length, isRoot);
-            leftIndex = mapped & 0xFFFFFFFFULL;
-            if(REPORT) printf("Detected unchanged part: %x(%u)\n", leftIndex, leftLength);
-            rightIndex = extendRecursive(mapped >> 32, length - leftLength, offset, deltaLength, data, false, false);
+            // If the left part is exactly what we already have
+            if(leftLength == length) {
+                leftIndex = isRoot ? deconstruct(construct(idx, level, isRoot), level, length, false) : idx;
+                if(REPORT) printf("Detected identical part: %x(%u)\n", leftIndex, leftLength);
+                rightIndex = insertZeroPrepended(data, deltaLength, offset, false);
 
-        // If the left part contains original data and zeroes
-        } else if(zeroExtendedLength >= leftLength) {
-            leftIndex = zeroExtend(idx, length, leftLength, isRoot, false);
-            rightIndex = insertZeroPrepended(data, deltaLength, rightOffset, false);
+            // If the left part is part of what we already have
+            } else if(leftLength < length) {
+                uint64_t mapped = construct(idx, level, length, isRoot);
+                assert(depth < MAX_DEPTH);
+                Frame& f = path[depth++];
+                f.newLength = newLength;
+                f.level = level;
+                f.toRoot = toRoot;
+                f.leftUnchanged = true;
+                f.leftIndex = mapped & 0xFFFFFFFFULL;
+                if(REPORT) printf("Detected unchanged part: %x(%u)\n", f.leftIndex, leftLength);
+                idx = mapped >> 32;
+                length = length - leftLength;
+                isRoot = false;
+                toRoot = false;
+                continue;
+
+            // If the left part contains original data and zeroes
+            } else if(zeroExtendedLength >= leftLength) {
+                leftIndex = zeroExtend(idx, length, leftLength, isRoot, false);
+                rightIndex = insertZeroPrepended(data, deltaLength, rightOffset, false);
+
+            // If the left part contains original data, maybe zeroes and definitely delta
+            } else {
+                assert(depth < MAX_DEPTH);
+                Frame& f = path[depth++];
+                f.newLength = newLength;
+                f.level = level;
+                f.toRoot = toRoot;
+                f.leftUnchanged = false;
+                f.rightData = data - (int32_t)rightOffset;
+                f.rightLength = newLength - (int32_t)leftLength;
+                deltaLength = -rightOffset;
+                toRoot = false;
+                continue;
+            }
 
-        // If the left part contains original data, maybe zeroes and definitely delta
-        } else {
-            leftIndex = extendRecursive(idx, length, offset, -rightOffset, data, isRoot, false);
-            rightIndex = deconstruct(data - (int32_t)rightOffset, newLength - (int32_t)leftLength, false);
+            result = deconstruct(((uint64_t)leftIndex) | (((uint64_t)rightIndex) << 32), level, newLength, toRoot);
+            break;
         }
 
-        return deconstruct(((uint64_t)leftIndex) | (((uint64_t)rightIndex) << 32), level, newLength, toRoot);
+        while(depth) {
+            Frame const& f = path[--depth];
+            uint32_t leftIndex, rightIndex;
+            if(f.leftUnchanged) {
+                leftIndex = f.leftIndex;
+                rightIndex = result;
+            } else {
+                leftIndex = result;
+                rightIndex = deconstruct(f.rightData, f.rightLength, false);
+            }
+            result = deconstruct(((uint64_t)leftIndex) | (((uint64_t)rightIndex) << 32), f.level, f.newLength, f.toRoot);
+        }
+        return result;
     }
 
     uint64_t zeroExtend(uint64_t idx, uint64_t length, uint32_t extendTo, bool isRoot, bool toRoot) {
@@ -2739,9 +3721,9 @@ private:
         //
         // buffer: . . [5 6] [1 2] [3 4] [a b] [c d] [e f] [g h]
 
-        for(uint32_t i = 2; i < length; ++i) {
-            bufferDest[i] = construct(bufferSrc[i], false);
-//            printf("%2u: %16zx <- %8x\n", i, bufferDest[i], bufferSrc[i]); fflush(stdout);
+        // Level [l, 2l) is read from the IDs in level [l/2, l), so a whole level is one batch
+        for(uint32_t levelStart = 2; levelStart < length; levelStart <<= 1) {
+            construct(bufferSrc + levelStart, bufferDest + levelStart, std::min(levelStart, length - levelStart));
         }
     }
 
@@ -2850,7 +3832,8 @@ private:
 
         auto projections = projection.getProjections();
 
-        uint64_t jump[projections];
+        ScratchArena::Frame frame(ScratchArena::local());
+        uint64_t* jump = frame.alloc<uint64_t>(projections);
         uint64_t jumps = 0;
 
         if constexpr(REPORT) printf("%*c", level*4, ' ');
@@ -3181,14 +4164,13 @@ private:
     void traverseP2_construct(uint64_t mapped, uint32_t length, uint32_t currentLocalOffset, uint32_t currentLength, uint32_t*& dest) {
         if(REPORT) printf("traverseP2_construct %zx %u %u %u %p\n", mapped, length, currentLocalOffset, currentLength, dest);
 
-        uint32_t lengthLevel = lengthToLevel(length);
         uint32_t leftLength = length / 2;
 
         struct {
             uint32_t idx;
             uint32_t length;
             uint32_t pLength;
-        } todo[lengthLevel];
+        } todo[MAX_DEPTH];
         uint32_t nTodos = 0;
 
         for(;;) {
@@ -3220,7 +4202,8 @@ private:
 
             {
                 uint32_t fullLength = 2 * leftLength;
-                uint64_t buffer[fullLength];
+                ScratchArena::Frame frame(ScratchArena::local());
+                uint64_t* buffer = frame.alloc<uint64_t>(fullLength);
                 constructTree(mapped, fullLength, buffer);
                 memcpy(dest, (uint32_t*)buffer + fullLength + currentLocalOffset, currentLength * sizeof(uint32_t));
                 if(REPORT) printf("traverseP2_construct: COPIED TO %p %zu\n", dest, currentLength * sizeof(uint32_t));
@@ -3285,11 +4268,10 @@ private:
             return mapped;
         }
 
-        uint32_t lengthLevel = lengthToLevel(length);
         uint32_t leftLength = length / 2;
 
-        uint64_t chain[lengthLevel+1];
-        bool right[lengthLevel+1];
+        uint64_t chain[MAX_DEPTH];
+        bool right[MAX_DEPTH];
 
         uint32_t level = 0;
 
@@ -3328,7 +4310,8 @@ private:
 
             {
                 uint32_t fullLength = 2 * leftLength;
-                uint64_t buffer[fullLength];
+                ScratchArena::Frame frame(ScratchArena::local());
+                uint64_t* buffer = frame.alloc<uint64_t>(fullLength);
                 constructTree(chain[level], fullLength, buffer);
                 currentLength = std::min(fullLength-currentLocalOffset, lengthToGo);
                 memcpy((uint32_t*)buffer + fullLength + currentLocalOffset, *src, currentLength * sizeof(uint32_t));
@@ -3514,9 +4497,9 @@ private:
         uint32_t leftLength = 1 << lengthLevel;
         uint32_t rightLength = length - leftLength;
 
-        uint64_t chain[lengthLevel+2];
-        bool right[lengthLevel+2];
-        uint32_t lengths[leftLength+2];
+        uint64_t chain[MAX_DEPTH];
+        bool right[MAX_DEPTH];
+        uint32_t lengths[MAX_DEPTH];
 
         uint32_t level = 0;
 
@@ -3559,7 +4542,8 @@ private:
 
             {
                 uint32_t fullLength = leftLength + rightLength;
-                uint64_t buffer[fullLength];
+                ScratchArena::Frame frame(ScratchArena::local());
+                uint64_t* buffer = frame.alloc<uint64_t>(fullLength);
                 constructTree(chain[level], fullLength, buffer);
                 currentLength = std::min(fullLength-currentLocalOffset, lengthToGo);
                 memcpy((uint32_t*)buffer + fullLength + currentLocalOffset, src, currentLength * sizeof(uint32_t));
@@ -3880,9 +4864,9 @@ private:
         uint32_t leftLength = 1 << lengthLevel;
         uint32_t rightLength = length - leftLength;
 
-        uint64_t chain[lengthLevel+2];
-        bool right[lengthLevel+2];
-        uint32_t lengths[leftLength+2];
+        uint64_t chain[MAX_DEPTH];
+        bool right[MAX_DEPTH];
+        uint32_t lengths[MAX_DEPTH];
         uint32_t currentLevel = 0;
         chain[0] = mapped;
         lengths[0] = length;
@@ -24,6 +24,28 @@
 #include <cstdio>
 #include <sys/mman.h>
 #include <thread>
+#include <vector>
+#include <dtree/mmapper.h>
+#include <dtree/wal.h>
+#ifdef __SSE4_2__
+#   include <nmmintrin.h>
+#endif
+#ifdef __AVX__
+#   include <immintrin.h>
+#endif
+
+/**
+ * When compiled with AVX2 or AVX-512, HashSet compares a whole group of 8 buckets against the key at once
+ * if its bucket finder probes in groups. Define DTREE_GROUP_PROBE to 0 to force the scalar probe loop.
+ * ThreadSanitizer does not see the vector loads as atomic, so it gets the scalar loop by default.
+ */
+#ifndef DTREE_GROUP_PROBE
+#   if (defined(__AVX2__) || defined(__AVX512F__)) && !defined(__SANITIZE_THREAD__)
+#       define DTREE_GROUP_PROBE 1
+#   else
+#       define DTREE_GROUP_PROBE 0
+#   endif
+#endif
 
 //
 //class HashSet {
@@ -155,95 +177,292 @@
 
 template<typename TREE>
 class RehasherExit {
+public:
+    static constexpr bool RESIZES = false;
 protected:
     __attribute__((always_inline))
     void rehash() {
 //        printf("taking too long\n");
 //        exit(0);
     }
+    __attribute__((always_inline))
+    bool rehashing() const {
+        return false;
+    }
 };
 
+/**
+ * @brief Rehasher that grows the hash set online to twice its size when it becomes too full.
+ * The thread that detects this maps the new table; from then on, every thread accessing the
+ * hash set helps migrating the old table in parts of REHASH_PART_SIZE buckets, claimed through
+ * _nextRehashPart. A thread only waits for parts that are still being migrated by others.
+ *
+ * Migrated empty buckets of the old table are frozen with Moved(), so inserts that still probe
+ * the old table cannot get lost: they either land before the migration of their bucket and are
+ * migrated, or run into a frozen bucket and are retried in the new table. This reserves the key
+ * Moved() (all ones).
+ *
+ * Migration moves entries, so positions returned by insert() and find() are only valid until the
+ * next rehash. Do not use it for storage that uses positions as IDs, like dtree.
+ *
+ * Old tables are kept mapped until destruction, since threads may still be probing them.
+ */
 template<typename TREE>
 class Rehasher {
+public:
+    static constexpr bool RESIZES = true;
+
+    /// Number of buckets of the old table that are migrated per claimed part
+    static constexpr size_t REHASH_PART_SIZE = 1ULL << 14;
+
+    /// Number of probes after which an insert considers the hash set too full
+    static constexpr size_t REHASH_MAX_PROBES = 1ULL << 12;
+
+    static constexpr uint64_t Moved() {
+        return 0xFFFFFFFFFFFFFFFFULL;
+    }
+
+    Rehasher()
+    : _nextRehashPart(0)
+    , _rehashPartsDone(0)
+    , _rehashParts(0)
+    , _rehashGeneration(0)
+    , _rehashFrom(nullptr)
+    , _rehashFromBuckets(0)
+    , _retired()
+    {}
+
+    ~Rehasher() {
+        for(auto& r: _retired) {
+            munmap(r.first, r.second);
+        }
+    }
+
 protected:
 
+    // Generation in the upper 32 bits, next part to migrate in the lower 32 bits
     std::atomic<size_t> _nextRehashPart;
+    std::atomic<size_t> _rehashPartsDone;
+    std::atomic<size_t> _rehashParts;
+
+    // Odd while a migration is in progress
+    std::atomic<size_t> _rehashGeneration;
+    std::atomic<uint64_t>* _rehashFrom;
+    size_t _rehashFromBuckets;
+    std::vector<std::pair<void*, size_t>> _retired;
+
+    TREE& tree() {
+        return *static_cast<TREE*>(this);
+    }
 
     __attribute__((always_inline))
     void rehash() {
+        rehash(_rehashGeneration.load(std::memory_order_acquire));
     }
+
     __attribute__((always_inline))
     bool rehashing() const {
-        return _nextRehashPart.load(std::memory_order_relaxed) > 0;
+        return _rehashGeneration.load(std::memory_order_relaxed) & 1;
+    }
+
+    /**
+     * Starts a migration to a table twice the size, unless the hash set is no longer at @c generation.
+     */
+    void rehash(size_t generation) {
+        if(generation & 1) return;
+        if(!_rehashGeneration.compare_exchange_strong(generation, generation + 1, std::memory_order_acq_rel)) return;
+
+        TREE& t = tree();
+        size_t buckets = t._buckets * 2;
+        MMapper::Pages backing;
+        auto map = (std::atomic<uint64_t>*)MMapper::mmapForMap(buckets * sizeof(uint64_t), t._pagePolicy, backing, t._numa);
+        if(!map) {
+            printf("Hash map full, could not grow to %zu buckets\n", buckets);
+            exit(-1);
+        }
+        t._pageBacking.store(backing, std::memory_order_relaxed);
+        MMapper::prefault(map, buckets * sizeof(uint64_t), backing, t._prefault, t._prefaultThreads, t._numa);
+        if(TREE::REPORT_HS) printf("Growing hash map to %zu buckets\n", buckets);
+
+        _rehashFrom = t._map;
+        _rehashFromBuckets = t._buckets;
+        _rehashParts.store((t._buckets + REHASH_PART_SIZE - 1) / REHASH_PART_SIZE, std::memory_order_relaxed);
+        _rehashPartsDone.store(0, std::memory_order_relaxed);
+
+        // Only threads that observed the migration in progress read these, after claiming a part
+        __atomic_store_n(&t._scale, t._scale + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&t._buckets, buckets, __ATOMIC_RELAXED);
+        __atomic_store_n(&t._entriesMask, buckets - 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&t._map, map, __ATOMIC_RELEASE);
+
+        _nextRehashPart.store((generation + 1) << 32, std::memory_order_release);
+    }
+
+    /**
+     * Helps migrating the parts of generation @c generation and waits until all of them are migrated.
+     */
+    void rehashHelp(size_t generation) {
+        TREE& t = tree();
+        size_t tag = generation << 32;
+        while(_rehashGeneration.load(std::memory_order_acquire) == generation) {
+            size_t part = _nextRehashPart.load(std::memory_order_acquire);
+            if((part & ~0xFFFFFFFFULL) != tag || (part & 0xFFFFFFFFULL) >= _rehashParts.load(std::memory_order_relaxed)) {
+                std::this_thread::yield();
+                continue;
+            }
+            if(!_nextRehashPart.compare_exchange_weak(part, part + 1, std::memory_order_acq_rel)) {
+                continue;
+            }
+
+            // Claiming a part keeps the migration of this generation from finishing
+            size_t begin = (part & 0xFFFFFFFFULL) * REHASH_PART_SIZE;
+            size_t end = std::min(begin + REHASH_PART_SIZE, _rehashFromBuckets);
+            size_t mask = t._entriesMask;
+            typename TREE::probeStats ps;
+            for(size_t idx = begin; idx < end; ++idx) {
+                uint64_t key = 0;
+                if(_rehashFrom[idx].compare_exchange_strong(key, Moved(), std::memory_order_acq_rel)) {
+                    continue;
+                }
+                if(t.template probe<1, 0>(t._map, mask, mask + 1, key, TREE::hash(key), ps) == TREE::Full()) {
+                    printf("Hash map full\n");
+                    exit(-1);
+                }
+            }
+
+            if(_rehashPartsDone.fetch_add(1, std::memory_order_acq_rel) + 1 == _rehashParts.load(std::memory_order_relaxed)) {
+                _retired.emplace_back(_rehashFrom, _rehashFromBuckets * sizeof(uint64_t));
+                _rehashGeneration.store(generation + 1, std::memory_order_release);
+            }
+        }
+    }
+
+    template<int INSERT, int TRACKING, typename PROBESTATS>
+    uint64_t rehashingInsertOrContains(uint64_t key, PROBESTATS& ps) {
+        assert(key != Moved() && "key is reserved by Rehasher");
+        TREE& t = tree();
+        while(true) {
+            size_t generation = _rehashGeneration.load(std::memory_order_acquire);
+            if(generation & 1) {
+                rehashHelp(generation);
+                continue;
+            }
+            std::atomic<uint64_t>* map = __atomic_load_n(&t._map, __ATOMIC_ACQUIRE);
+            size_t mask = __atomic_load_n(&t._entriesMask, __ATOMIC_ACQUIRE);
+            if(_rehashGeneration.load(std::memory_order_acquire) != generation) {
+                continue;
+            }
+            assert(map && "storage not initialized");
+            size_t maxProbes = INSERT ? std::min(mask + 1, REHASH_MAX_PROBES) : mask + 1;
+            uint64_t result = t.template probe<INSERT, TRACKING>(map, mask, maxProbes, key, TREE::hash(key), ps);
+            if(result != TREE::Full()) {
+                return result;
+            }
+            rehash(generation);
+        }
     }
 };
 
 template<typename TREE>
 class Linear {
 public:
+    static constexpr bool GROUPED = false;
+
     TREE& tree;
     uint64_t& e;
+    uint64_t mask;
 
-    Linear(TREE& tree, uint64_t& e): tree(tree), e(e) {}
+    Linear(TREE& tree, uint64_t& e): Linear(tree, e, tree._entriesMask) {}
+    Linear(TREE& tree, uint64_t& e, uint64_t mask): tree(tree), e(e), mask(mask) {}
 
     __attribute__((always_inline))
     void next() {
-        e = (e+1) & tree._entriesMask;
+        e = (e+1) & mask;
 //        e += e == 0;
     }
 };
 
+/**
+ * @brief Probes the 8 buckets of a 64-byte group, starting at the hashed bucket and wrapping around within
+ * the group, then jumps to the next group with increasing steps.
+ */
 template<typename TREE>
 class QuadLinear {
 public:
+    static constexpr bool GROUPED = true;
+
     TREE& tree;
     uint64_t& e;
     uint64_t eBase;
     uint64_t eOrig;
     uint64_t inc;
+    uint64_t mask;
 
-    QuadLinear(TREE& tree, uint64_t& e): tree(tree), e(e), eBase(e & ~0x7ULL), eOrig(e & 0x7ULL), inc(1) {}
+    QuadLinear(TREE& tree, uint64_t& e): QuadLinear(tree, e, tree._entriesMask) {}
+    QuadLinear(TREE& tree, uint64_t& e, uint64_t mask): tree(tree), e(e), eBase(e & ~0x7ULL), eOrig(e & 0x7ULL), inc(1), mask(mask) {}
 
     __attribute__((always_inline))
     void next() {
         e = (e + 1) & 0x7ULL;
         if(e == eOrig) {
-            uint32_t diff = (inc*2);
-            diff -= __builtin_popcount(diff);
-            eBase = (eBase + diff*8) & tree._entriesMask;
-
-            if(TREE::REPORT_HS) printf("  jump to %zu (%zu)\n", eBase, inc);
-            inc++;
-            if(inc==1000) {
-                tree.rehash();
-            }
+            nextGroup();
+            return;
         }
         e += eBase;
 //        e += e == 0;
     }
+
+    /**
+     * @brief Skips the remaining buckets of the current group, i.e., the bucket next() would reach after
+     * wrapping around the group.
+     */
+    __attribute__((always_inline))
+    void nextGroup() {
+        uint32_t diff = (inc*2);
+        diff -= __builtin_popcount(diff);
+        eBase = (eBase + diff*8) & mask;
+
+        if(TREE::REPORT_HS) printf("  jump to %zu (%zu)\n", eBase, inc);
+        inc++;
+        if(inc==1000) {
+            tree.rehash();
+        }
+        e = eBase + eOrig;
+    }
 };
 
 template<typename TREE>
 class LinearLinear {
 public:
+    static constexpr bool GROUPED = true;
+
     TREE& tree;
     uint64_t& e;
     uint64_t eBase;
     uint64_t eOrig;
+    uint64_t mask;
 
-    LinearLinear(TREE& tree, uint64_t& e): tree(tree), e(e), eBase(e & ~0x7ULL), eOrig(e & 0x7ULL) {}
+    LinearLinear(TREE& tree, uint64_t& e): LinearLinear(tree, e, tree._entriesMask) {}
+    LinearLinear(TREE& tree, uint64_t& e, uint64_t mask): tree(tree), e(e), eBase(e & ~0x7ULL), eOrig(e & 0x7ULL), mask(mask) {}
 
     __attribute__((always_inline))
     void next() {
         e = (e + 1) & 0x7ULL;
         if(e == eOrig) {
-            eBase = (eBase + 8) & tree._entriesMask;
-
-            if(TREE::REPORT_HS) printf("  jump to %u\n", eBase);
+            nextGroup();
+            return;
         }
         e += eBase;
 //        e += e == 0;
     }
+
+    __attribute__((always_inline))
+    void nextGroup() {
+        eBase = (eBase + 8) & mask;
+
+        if(TREE::REPORT_HS) printf("  jump to %zu\n", eBase);
+        e = eBase + eOrig;
+    }
 };
 
 template<typename TREE>
@@ -326,6 +545,154 @@ struct HashCompare {
     }
 };
 
+/**
+ * @brief Murmur3 64-bit finalizer. Spreads sequential keys over the whole table.
+ */
+template<typename T>
+struct HashMurmur64 {
+
+    __attribute__((always_inline))
+    bool equal( const T& j, const T& k ) const {
+        return j == k;
+    }
+
+    __attribute__((always_inline))
+    size_t hash( const T& k ) const {
+        uint64_t h = k;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+/**
+ * @brief Hashes both words of a 128-bit key: the high word is multiplied into the low word before
+ * the finalizer.
+ */
+template<>
+struct HashMurmur64<unsigned __int128> {
+
+    __attribute__((always_inline))
+    bool equal( const unsigned __int128& j, const unsigned __int128& k ) const {
+        return j == k;
+    }
+
+    __attribute__((always_inline))
+    size_t hash( const unsigned __int128& k ) const {
+        uint64_t hi = k >> 64;
+        return HashMurmur64<uint64_t>().hash((uint64_t)k ^ (hi * 0x9E3779B97F4A7C15ULL));
+    }
+};
+
+/**
+ * @brief CRC32-C of the key, using the SSE4.2 crc32 instruction when compiled with -msse4.2.
+ * The key is hashed twice, once rotated, to obtain 64 bits.
+ */
+template<typename T>
+struct HashCRC32C {
+
+    __attribute__((always_inline))
+    bool equal( const T& j, const T& k ) const {
+        return j == k;
+    }
+
+    __attribute__((always_inline))
+    size_t hash( const T& k ) const {
+        uint64_t h = k;
+        return crc32c(0, h) | (crc32c(0, (h >> 32) | (h << 32)) << 32);
+    }
+
+    __attribute__((always_inline))
+    static uint64_t crc32c(uint64_t crc, uint64_t v) {
+#ifdef __SSE4_2__
+        return _mm_crc32_u64(crc, v);
+#else
+        for(int i = 0; i < 64; ++i) {
+            uint32_t bit = (crc ^ (uint32_t)(v >> i)) & 1;
+            crc = (crc >> 1) ^ (0x82F63B78 & -bit);
+        }
+        return crc;
+#endif
+    }
+};
+
+/**
+ * @brief Hashes both words of a 128-bit key by continuing the CRC over the high word.
+ */
+template<>
+struct HashCRC32C<unsigned __int128> {
+
+    __attribute__((always_inline))
+    bool equal( const unsigned __int128& j, const unsigned __int128& k ) const {
+        return j == k;
+    }
+
+    __attribute__((always_inline))
+    size_t hash( const unsigned __int128& k ) const {
+        uint64_t lo = k;
+        uint64_t hi = k >> 64;
+        uint64_t h1 = HashCRC32C<uint64_t>::crc32c(HashCRC32C<uint64_t>::crc32c(0, lo), hi);
+        uint64_t h2 = HashCRC32C<uint64_t>::crc32c(HashCRC32C<uint64_t>::crc32c(0, (lo >> 32) | (lo << 32)), (hi >> 32) | (hi << 32));
+        return h1 | (h2 << 32);
+    }
+};
+
+/**
+ * @brief xxHash64-style mixer: one round of xxHash64 followed by its avalanche, without seed.
+ */
+template<typename T>
+struct HashXX64 {
+
+    __attribute__((always_inline))
+    bool equal( const T& j, const T& k ) const {
+        return j == k;
+    }
+
+    __attribute__((always_inline))
+    size_t hash( const T& k ) const {
+        uint64_t h = k;
+        h *= 0xC2B2AE3D27D4EB4FULL;
+        h = (h << 31) | (h >> 33);
+        h *= 0x9E3779B185EBCA87ULL;
+        h ^= h >> 33;
+        h *= 0xC2B2AE3D27D4EB4FULL;
+        h ^= h >> 29;
+        h *= 0x165667B19E3779F9ULL;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
+/**
+ * @brief Hashes both words of a 128-bit key: one xxHash64 round per word before the avalanche.
+ */
+template<>
+struct HashXX64<unsigned __int128> {
+
+    __attribute__((always_inline))
+    bool equal( const unsigned __int128& j, const unsigned __int128& k ) const {
+        return j == k;
+    }
+
+    __attribute__((always_inline))
+    size_t hash( const unsigned __int128& k ) const {
+        uint64_t lo = (uint64_t)k * 0xC2B2AE3D27D4EB4FULL;
+        uint64_t hi = (uint64_t)(k >> 64) * 0xC2B2AE3D27D4EB4FULL;
+        lo = ((lo << 31) | (lo >> 33)) * 0x9E3779B185EBCA87ULL;
+        hi = ((hi << 31) | (hi >> 33)) * 0x9E3779B185EBCA87ULL;
+        uint64_t h = lo ^ ((hi << 27) | (hi >> 37));
+        h ^= h >> 33;
+        h *= 0xC2B2AE3D27D4EB4FULL;
+        h ^= h >> 29;
+        h *= 0x165667B19E3779F9ULL;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
 class HashSetBase {
 public:
     struct probeStats {
@@ -360,6 +727,119 @@ public:
         }
     };
 
+    /**
+     * @brief The probeStats of the threads mapped to one tracking slot, padded to a cache line so the
+     * slots of different threads do not share one. Only its own thread writes a slot, so the counters
+     * are updated with a relaxed load and store instead of an atomic read-modify-write.
+     */
+    struct alignas(64) threadProbeStats: probeStats {
+
+        /**
+         * @brief Returns a copy of the counters that is safe to take while the owning thread updates them.
+         */
+        probeStats load() const {
+            probeStats ps;
+            ps.insertsExisting = __atomic_load_n(&insertsExisting, __ATOMIC_RELAXED);
+            ps.insertsNew = __atomic_load_n(&insertsNew, __ATOMIC_RELAXED);
+            ps.finds = __atomic_load_n(&finds, __ATOMIC_RELAXED);
+            ps.probeCount = __atomic_load_n(&probeCount, __ATOMIC_RELAXED);
+            ps.firstProbe = __atomic_load_n(&firstProbe, __ATOMIC_RELAXED);
+            ps.finalProbe = __atomic_load_n(&finalProbe, __ATOMIC_RELAXED);
+            ps.failedCAS = __atomic_load_n(&failedCAS, __ATOMIC_RELAXED);
+            return ps;
+        }
+    };
+
+    /**
+     * @brief Histograms of the cost of single operations, per type of operation. Bucket b of a histogram
+     * counts the operations with a cost c for which 64 - clz(c) == b, i.e., bucket 0 counts c == 0 and bucket
+     * b > 0 counts c in [2^(b-1), 2^b). The last bucket also counts all larger costs. Only recorded by hash
+     * sets with GLOBAL_TRACKING >= 2.
+     */
+    struct probeHistograms {
+        static constexpr size_t BUCKETS = 24;
+
+        enum Operation {
+            INSERT_NEW,
+            INSERT_EXISTING,
+            FIND,
+            OPERATIONS
+        };
+
+        probeHistograms(): probes(), failedCAS(), groupJumps() {}
+
+        size_t probes[OPERATIONS][BUCKETS];         // Buckets examined
+        size_t failedCAS[OPERATIONS][BUCKETS];      // Lost races for an empty bucket
+        size_t groupJumps[OPERATIONS][BUCKETS];     // Jumps to another group of 8 buckets, 0 for ungrouped finders
+
+        static size_t bucket(size_t c) {
+            return std::min(c ? (size_t)(64 - __builtin_clzll(c)) : 0, BUCKETS - 1);
+        }
+
+        /**
+         * @brief Returns the number of operations of type @p op.
+         */
+        size_t operations(Operation op) const {
+            size_t n = 0;
+            for(size_t b = 0; b < BUCKETS; ++b) {
+                n += probes[op][b];
+            }
+            return n;
+        }
+
+        /**
+         * @brief Returns the upper bound of the bucket of @p histogram, e.g., probes[INSERT_NEW], in which
+         * percentile @p p in [0, 1] of the operations falls.
+         */
+        static size_t percentile(const size_t (&histogram)[BUCKETS], double p) {
+            size_t total = 0;
+            for(size_t b = 0; b < BUCKETS; ++b) {
+                total += histogram[b];
+            }
+            size_t seen = 0;
+            for(size_t b = 0; b < BUCKETS; ++b) {
+                seen += histogram[b];
+                if(seen && seen >= p * total) return b ? (1ULL << b) - 1 : 0;
+            }
+            return ~0ULL;
+        }
+
+        probeHistograms& operator+=(const probeHistograms& other) {
+            for(size_t op = 0; op < OPERATIONS; ++op) {
+                for(size_t b = 0; b < BUCKETS; ++b) {
+                    probes[op][b] += other.probes[op][b];
+                    failedCAS[op][b] += other.failedCAS[op][b];
+                    groupJumps[op][b] += other.groupJumps[op][b];
+                }
+            }
+            return *this;
+        }
+    };
+
+    /**
+     * @brief The probeHistograms of the threads mapped to one tracking slot, written like threadProbeStats.
+     */
+    struct alignas(64) threadProbeHistograms: probeHistograms {
+
+        probeHistograms load() const {
+            probeHistograms h;
+            for(size_t op = 0; op < probeHistograms::OPERATIONS; ++op) {
+                for(size_t b = 0; b < probeHistograms::BUCKETS; ++b) {
+                    h.probes[op][b] = __atomic_load_n(&this->probes[op][b], __ATOMIC_RELAXED);
+                    h.failedCAS[op][b] = __atomic_load_n(&this->failedCAS[op][b], __ATOMIC_RELAXED);
+                    h.groupJumps[op][b] = __atomic_load_n(&this->groupJumps[op][b], __ATOMIC_RELAXED);
+                }
+            }
+            return h;
+        }
+    };
+
+    /**
+     * @brief Number of tracking slots of a hash set with GLOBAL_TRACKING. Threads beyond this number
+     * share slots, which may lose a count now and then but is never undefined.
+     */
+    static constexpr size_t TRACKING_SLOTS = 128;
+
     struct mapStats {
         size_t bytesReserved;
         size_t bytesUsed;
@@ -378,6 +858,230 @@ public:
     static constexpr uint64_t NotFound() {
         return 0xFFFFFFFFFFFFFFFFULL;
     }
+
+    /**
+     * Returned by a probe that gave up before finding the key or an empty bucket.
+     */
+    static constexpr uint64_t Full() {
+        return 0xFFFFFFFFFFFFFFFEULL;
+    }
+
+    /**
+     * @brief Returns a number unique to the calling thread, assigned on first use in order of arrival.
+     */
+    static size_t threadSlot() {
+        static std::atomic<size_t> next(0);
+        static thread_local size_t slot = ~0ULL;
+        if(__builtin_expect(slot == ~0ULL, 0)) {
+            slot = next.fetch_add(1, std::memory_order_relaxed);
+        }
+        return slot;
+    }
+
+    __attribute__((always_inline))
+    static void track(size_t& counter, size_t n) {
+        __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * @brief Records an operation of type @p op that examined @p probes buckets and lost @p failedCAS races
+     * in @p h. With a grouped bucket finder, every 8 probes after the first bucket is a jump to a new group.
+     */
+    template<bool GROUPED>
+    __attribute__((always_inline))
+    static void trackOperation(threadProbeHistograms& h, typename probeHistograms::Operation op, size_t probes, size_t failedCAS) {
+        track(h.probes[op][probeHistograms::bucket(probes)], 1);
+        track(h.failedCAS[op][probeHistograms::bucket(failedCAS)], 1);
+        track(h.groupJumps[op][probeHistograms::bucket(GROUPED ? (probes - 1) / 8 : 0)], 1);
+    }
+
+    /**
+     * @brief Sets the number of threads getStats() and getDensityStats() split their scan of the table over.
+     * The threads are started per scan.
+     */
+    void setScanThreads(size_t threads) {
+        _scanThreads = std::max((size_t)1, threads);
+    }
+
+    /**
+     * @brief Enables or disables counting the inserted elements in per-thread slots, so getElementsApprox()
+     * does not need to scan the table. Elements inserted while counting is disabled are not counted.
+     */
+    void setCountElements(bool count) {
+        _countElements = count;
+    }
+
+    /**
+     * @brief Returns the number of elements inserted while counting was enabled, in O(TRACKING_SLOTS).
+     * Threads that share a slot may lose an increment now and then, hence approximate.
+     */
+    size_t getElementsApprox() const {
+        size_t elements = 0;
+        for(auto& e: _threadElements) {
+            elements += __atomic_load_n(&e.value, __ATOMIC_RELAXED);
+        }
+        return elements;
+    }
+
+    __attribute__((always_inline))
+    void countInserted(uint64_t result) {
+        if(__builtin_expect(_countElements, 0) && (result & 0x8000000000000000ULL) && result != NotFound()) {
+            track(_threadElements[threadSlot() & (TRACKING_SLOTS - 1)].value, 1);
+        }
+    }
+
+    /**
+     * @brief Logs the newly inserted buckets of this hash set to @p log as table @p table, or stops logging
+     * if @p log is nullptr. The IDs of the hash set may not change, so it may not use a resizing Rehasher.
+     */
+    void setWriteAheadLog(WriteAheadLog* log, uint32_t table) {
+        _log = log;
+        _logTable = table;
+    }
+
+    /**
+     * @brief Counts and logs @p result if it is a newly inserted ID, holding @p key and @p key2.
+     */
+    __attribute__((always_inline))
+    void inserted(uint64_t result, uint64_t key, uint64_t key2 = 0) {
+        countInserted(result);
+        if(__builtin_expect(_log != nullptr, 0) && (result & 0x8000000000000000ULL) && result != NotFound()) {
+            _log->append(_logTable, result & 0x7FFFFFFFFFFFFFFFULL, key, key2);
+        }
+    }
+
+    /**
+     * @brief Returns the number of nonzero words among the words at multiples of STRIDE in [@p begin, @p end).
+     * @p begin must be a multiple of STRIDE.
+     */
+    template<size_t STRIDE = 1>
+    static size_t countNonZero(const std::atomic<uint64_t>* map, size_t begin, size_t end) {
+        static_assert(STRIDE == 1 || STRIDE == 2, "only strides 1 and 2 are supported");
+        size_t count = 0;
+        size_t idx = begin;
+#if DTREE_GROUP_PROBE
+#   ifdef __AVX512F__
+        constexpr uint32_t lanes = STRIDE == 1 ? 0xFF : 0x55;
+        for(; idx + 8 <= end; idx += 8) {
+            __m512i v = _mm512_loadu_si512((const void*)&map[idx]);
+            count += __builtin_popcount(_mm512_test_epi64_mask(v, v) & lanes);
+        }
+#   else
+        constexpr uint32_t lanes = STRIDE == 1 ? 0xF : 0x5;
+        for(; idx + 4 <= end; idx += 4) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)&map[idx]);
+            uint32_t zero = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, _mm256_setzero_si256())));
+            count += __builtin_popcount(~zero & lanes);
+        }
+#   endif
+#endif
+        for(; idx < end; idx += STRIDE) {
+            count += map[idx].load(std::memory_order_relaxed) != 0;
+        }
+        return count;
+    }
+
+    /**
+     * @brief Calls @p func(begin, end, part) for @p threads consecutive parts of [0, @p n), in parallel.
+     */
+    template<typename FUNC>
+    static void parallelFor(size_t n, size_t threads, FUNC&& func) {
+        threads = std::max((size_t)1, std::min(threads, n));
+        std::vector<std::thread> workers;
+        for(size_t t = 1; t < threads; ++t) {
+            workers.emplace_back([&func, n, threads, t]() {
+                func(n * t / threads, n * (t + 1) / threads, t);
+            });
+        }
+        func(0, n / threads, 0);
+        for(auto& w: workers) {
+            w.join();
+        }
+    }
+
+    /**
+     * @brief Sets the largest pages the table may be backed with, see MMapper. Takes effect on init() and
+     * when a Rehasher grows the table.
+     */
+    void setPagePolicy(MMapper::Pages policy) {
+        _pagePolicy = policy;
+    }
+
+    /**
+     * @brief Sets how the pages of the table are placed over NUMA nodes, see MMapper. Takes effect on init()
+     * and when a Rehasher grows the table.
+     */
+    void setNumaPolicy(MMapper::NumaPolicy numa) {
+        _numa = numa;
+    }
+
+    MMapper::NumaPolicy getNumaPolicy() const {
+        return _numa;
+    }
+
+    /**
+     * @brief Sets whether and how the table is backed before use, see MMapper::prefault(), using up to
+     * @p threads threads; 0 means one per hardware thread. Takes effect on init() and when a Rehasher grows
+     * the table.
+     */
+    void setPrefault(MMapper::Prefault mode, size_t threads = 0) {
+        _prefault = mode;
+        _prefaultThreads = threads;
+    }
+
+    /**
+     * @brief Returns the pages that back the current table.
+     */
+    MMapper::Pages getPageBacking() const {
+        return _pageBacking.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Fingerprints the probe sequence of the bucket finder BF of @p set, by mixing the first buckets
+     * it probes from a fixed bucket of a fixed table. Two bucket finders that place an element differently
+     * give a different fingerprint.
+     */
+    template<typename BF, typename HS>
+    static uint64_t getProbeCheck(HS& set) {
+        uint64_t e = 0x1235;
+        uint64_t check = 0xCBF29CE484222325ULL;
+        BF searcher(set, e, 0xFFFF);
+        for(int i = 0; i < 64; ++i) {
+            check = (check ^ e) * 0x100000001B3ULL;
+            searcher.next();
+        }
+        return check;
+    }
+
+    /**
+     * @brief Maps a zeroed table of @p bytes according to the page policy and records the backing obtained.
+     */
+    void* mapTable(size_t bytes) {
+        MMapper::Pages obtained;
+        void* map = MMapper::mmapForMap(bytes, _pagePolicy, obtained, _numa);
+        if(!map) {
+            printf("Could not map %zu bytes\n", bytes);
+            exit(-1);
+        }
+        _pageBacking.store(obtained, std::memory_order_relaxed);
+        MMapper::prefault(map, bytes, obtained, _prefault, _prefaultThreads, _numa);
+        return map;
+    }
+
+    struct alignas(64) threadCounter {
+        size_t value = 0;
+    };
+
+    size_t _scanThreads = 1;
+    bool _countElements = false;
+    MMapper::Pages _pagePolicy = MMapper::Pages::SMALL;
+    MMapper::NumaPolicy _numa;
+    MMapper::Prefault _prefault = MMapper::Prefault::LAZY;
+    size_t _prefaultThreads = 0;
+    std::atomic<MMapper::Pages> _pageBacking{MMapper::Pages::SMALL};
+    threadCounter _threadElements[TRACKING_SLOTS];
+    WriteAheadLog* _log = nullptr;
+    uint32_t _logTable = 0;
 };
 
 template< template<typename> typename REHASHER
@@ -392,6 +1096,12 @@ public:
 
     using Bucketfinder = BUCKETFINDER<HashSet<REHASHER, BUCKETFINDER, HASH, GLOBAL_TRACKING>>;
     friend Bucketfinder;
+
+    using RehashPolicy = REHASHER<HashSet<REHASHER, BUCKETFINDER, HASH, GLOBAL_TRACKING>>;
+    static constexpr bool GROUP_PROBE = DTREE_GROUP_PROBE && Bucketfinder::GROUPED;
+    static constexpr size_t PREFETCH_DISTANCE = 16;
+    static constexpr size_t BUCKET_WORDS = 1;
+    friend RehashPolicy;
 public:
 
 //    HashSet(): _scale(0), _buckets(0), _entriesMask(0), _map(nullptr) {
@@ -418,15 +1128,56 @@ public:
 
     HashSet& init() {
         assert(!_map && "map already in use");
-        _map = (decltype(_map))mmap(nullptr, _buckets * sizeof(uint64_t), PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
-        assert(_map && "failed to mmap data");
+        _map = (decltype(_map))mapTable(_buckets * sizeof(uint64_t));
         return *this;
     }
 
-    uint32_t entry(uint64_t key) {
+    /**
+     * @brief The table, for Snapshot. Not valid while a Rehasher migrates the table.
+     */
+    const void* getTable() const {
+        assert(!RehashPolicy::rehashing() && "table is being migrated");
+        return _map;
+    }
+
+    size_t getTableBytes() const {
+        return _buckets * sizeof(uint64_t);
+    }
+
+    /**
+     * @brief Identifies the hash function, the bucket finder and the bucket layout, so a Snapshot is not
+     * opened by a hash set that places or stores elements differently.
+     */
+    uint64_t getHashCheck() const {
+        uint64_t check = HASH<uint64_t>().hash(0x0123456789ABCDEFULL);
+        check ^= getProbeCheck<Bucketfinder>(const_cast<HashSet&>(*this));
+        return check ^ ((uint64_t)BUCKET_WORDS << 56);
+    }
+
+    /**
+     * @brief Uses the table of @p bytes at @p map, e.g., mapped from a Snapshot, instead of init().
+     * @param backing The pages that back @p map.
+     */
+    HashSet& adoptTable(void* map, size_t bytes, MMapper::Pages backing = MMapper::Pages::SMALL) {
+        assert(!_map && "map already in use");
+        setScale(__builtin_ctzll(bytes / sizeof(uint64_t)));
+        _map = (decltype(_map))map;
+        _pageBacking.store(backing, std::memory_order_relaxed);
+        return *this;
+    }
+
+    /**
+     * @brief Puts @p key in bucket @p id, e.g., when replaying a WriteAheadLog.
+     */
+    void restore(uint64_t id, uint64_t key, uint64_t) {
+        assert(id < _buckets);
+        _map[id].store(key, std::memory_order_relaxed);
+    }
+
+    uint64_t entry(uint64_t key) {
 //        uint32_t h = MurmurHash64(key);
 //        uint32_t h = MurmurHash64(&key, sizeof(size_t), seedForZero);
-        uint32_t h = HASH<uint64_t>().hash(key);
+        uint64_t h = HASH<uint64_t>().hash(key);
         return h & _entriesMask;
     }
 
@@ -437,27 +1188,69 @@ public:
 
     template<int INSERT, int TRACKING>
     uint64_t insertOrContains(uint64_t key, probeStats& ps) {
-        assert(_map && "storage not initialized");
+        return insertOrContains<INSERT, TRACKING>(key, hash(key), ps);
+    }
+
+    /**
+     * @brief Same as insertOrContains(key, ps), for a key of which the hash @p h is already computed.
+     */
+    template<int INSERT, int TRACKING>
+    uint64_t insertOrContains(uint64_t key, uint64_t h, probeStats& ps) {
         if(!key) return 0ULL;
-        uint64_t e = entry(key);
+        if constexpr(RehashPolicy::RESIZES) {
+            assert(!_log && "IDs of a resizing hash set cannot be logged");
+            uint64_t result = this->template rehashingInsertOrContains<INSERT, TRACKING>(key, ps);
+            if constexpr(INSERT) countInserted(result);
+            return result;
+        }
+        assert(_map && "storage not initialized");
+        uint64_t result = probe<INSERT, TRACKING>(_map, _entriesMask, _buckets, key, h, ps);
+        if(result == Full()) {
+            if(REPORT_HS) printf("Hash map full\n");
+            printf("Hash map full\n");
+            exit(-1);
+        }
+        if constexpr(INSERT) inserted(result, key);
+        return result;
+    }
+
+    __attribute__((always_inline))
+    static uint64_t hash(uint64_t key) {
+        return HASH<uint64_t>().hash(key);
+    }
+
+    /**
+     * Looks for @c key in the table @c map with mask @c mask, starting at bucket @c hash & @c mask,
+     * inserting it if INSERT is set.
+     * Returns Full() after @c maxProbes probes without finding @c key or an empty bucket.
+     */
+    template<int INSERT, int TRACKING>
+    uint64_t probe(std::atomic<uint64_t>* map, size_t mask, size_t maxProbes, uint64_t key, uint64_t hash, probeStats& ps) {
+        uint64_t e = hash & mask;
         e += e == 0;
-        Bucketfinder searcher(*this, e);
+        Bucketfinder searcher(*this, e, mask);
         if(TRACKING) {
             ps.firstProbe = e;
             ps.probeCount = 1;
             ps.failedCAS = 0;
         }
-        if(GLOBAL_TRACKING) _probeStats.probeCount++;
-        std::atomic<uint64_t>* current = &_map[e];
+        if(GLOBAL_TRACKING) track(trackedStats().probeCount, 1);
+
+        if constexpr(GROUP_PROBE) {
+            return probeGroups<INSERT, TRACKING>(map, mask, maxProbes, key, e, searcher, ps);
+        }
+
+        std::atomic<uint64_t>* current = &map[e];
 
         size_t probeCount = 1;
+        size_t failedCAS = 0;
 
 //        size_t maxProbes = _buckets / 8;
         if(REPORT || REPORT_HS) {
             printf("Inserting/finding %16zx\n", key);
         }
 
-        while(probeCount < _buckets) {
+        while(probeCount < maxProbes) {
             if(REPORT_HS) printf("e: %zx\n", e);
             uint64_t k = current->load(std::memory_order_relaxed);
             if(k == 0ULL) {
@@ -466,17 +1259,20 @@ public:
                 if(e == 0) goto findnext;
                 if constexpr(!INSERT) {
                     if(REPORT) printf("\033[34mNo such mapping %16zx -> ?\033[0m\n", key);
-                    if(GLOBAL_TRACKING) _probeStats.finds++;
+                    if(GLOBAL_TRACKING) track(trackedStats().finds, 1);
+                    trackOperation<INSERT>(false, probeCount, failedCAS);
                     return NotFound();
                 }
                 if(current->compare_exchange_strong(k, key, std::memory_order_release, std::memory_order_relaxed)) {
                     if(REPORT_HS) printf("  inserted\n");
                     if(REPORT) printf("\033[34mMapped %16zx -> %16zx\033[0m\n", key, e);
-                    if(GLOBAL_TRACKING) _probeStats.insertsNew++;
+                    if(GLOBAL_TRACKING) track(trackedStats().insertsNew, 1);
+                    trackOperation<INSERT>(true, probeCount, failedCAS);
                     return newlyInserted(e);
                 } else {
                     if(TRACKING) ps.failedCAS++;
-                    if(GLOBAL_TRACKING) _probeStats.failedCAS++;
+                    failedCAS++;
+                    if(GLOBAL_TRACKING) track(trackedStats().failedCAS, 1);
                 }
             }
             if(k == key) {
@@ -491,14 +1287,18 @@ public:
 //                } else
                 if(REPORT) printf("\033[34mUsed   %16zx -> %16zx\033[0m\n", key, e);
                 if(REPORT_HS) printf("  found\n");
-                if(GLOBAL_TRACKING) _probeStats.insertsExisting++;
+                if(GLOBAL_TRACKING) track(trackedStats().insertsExisting, 1);
+                trackOperation<INSERT>(false, probeCount, failedCAS);
                 return e;
             }
+            if constexpr(RehashPolicy::RESIZES) {
+                if(k == RehashPolicy::Moved()) return Full();
+            }
             findnext:
             searcher.next();
             if(TRACKING) ps.probeCount++;
-            if(GLOBAL_TRACKING) _probeStats.probeCount++;
-            current = &_map[e];
+            if(GLOBAL_TRACKING) track(trackedStats().probeCount, 1);
+            current = &map[e];
             probeCount++;
         }
 //        if(key > 0xffffffffull) {
@@ -510,11 +1310,103 @@ public:
 //            }
 //            printf("-> %8x\n", e);
 //        } else
-        if(REPORT_HS) printf("Hash map full\n");
-        printf("Hash map full\n");
-        exit(-1);
-        return NotFound();
+        return Full();
+    }
+
+    /**
+     * @brief Same as probe(), but examines a group of 8 buckets with one comparison against the key, 0 and
+     * Moved(). The buckets that match are visited in the order the bucket finder would visit them, so the
+     * result and the probe statistics are identical to the scalar loop.
+     */
+    template<int INSERT, int TRACKING>
+    uint64_t probeGroups(std::atomic<uint64_t>* map, size_t mask, size_t maxProbes, uint64_t key, uint64_t& e, Bucketfinder& searcher, probeStats& ps) {
+        assert(mask >= 7 && "group probing needs at least 8 buckets");
+        uint64_t other = 0;
+        if constexpr(RehashPolicy::RESIZES) other = RehashPolicy::Moved();
+        uint64_t start = e & 0x7ULL;
+        size_t probeCount = 1;
+        size_t failedCAS = 0;
+        while(probeCount < maxProbes) {
+            uint64_t base = e & ~0x7ULL;
+            uint32_t m = groupMatch(&map[base], key, other);
+            m = ((m >> start) | (m << (8 - start))) & 0xFF;
+            if(maxProbes - probeCount < 8) m &= (1U << (maxProbes - probeCount)) - 1;
+            while(m) {
+                uint32_t pos = __builtin_ctz(m);
+                m &= m - 1;
+                e = base + ((start + pos) & 0x7ULL);
+                uint64_t k = map[e].load(std::memory_order_relaxed);
+                if(k == 0ULL) {
+
+                    // Make sure we do not use the 0th index
+                    if(e == 0) continue;
+                    if constexpr(!INSERT) {
+                        if(TRACKING) ps.probeCount += pos;
+                        if(GLOBAL_TRACKING) track(trackedStats().probeCount, pos);
+                        if(GLOBAL_TRACKING) track(trackedStats().finds, 1);
+                        trackOperation<INSERT>(false, probeCount + pos, failedCAS);
+                        return NotFound();
+                    }
+                    if(map[e].compare_exchange_strong(k, key, std::memory_order_release, std::memory_order_relaxed)) {
+                        if(TRACKING) ps.probeCount += pos;
+                        if(GLOBAL_TRACKING) track(trackedStats().probeCount, pos);
+                        if(GLOBAL_TRACKING) track(trackedStats().insertsNew, 1);
+                        trackOperation<INSERT>(true, probeCount + pos, failedCAS);
+                        return newlyInserted(e);
+                    } else {
+                        if(TRACKING) ps.failedCAS++;
+                        failedCAS++;
+                        if(GLOBAL_TRACKING) track(trackedStats().failedCAS, 1);
+                    }
+                }
+                if(k == key) {
+                    if(TRACKING) ps.probeCount += pos;
+                    if(GLOBAL_TRACKING) track(trackedStats().probeCount, pos);
+                    if(GLOBAL_TRACKING) track(trackedStats().insertsExisting, 1);
+                    trackOperation<INSERT>(false, probeCount + pos, failedCAS);
+                    return e;
+                }
+                if constexpr(RehashPolicy::RESIZES) {
+                    if(k == RehashPolicy::Moved()) return Full();
+                }
+            }
+            searcher.nextGroup();
+            if(TRACKING) ps.probeCount += 8;
+            if(GLOBAL_TRACKING) track(trackedStats().probeCount, 8);
+            probeCount += 8;
+        }
+        return Full();
+    }
+
+#if DTREE_GROUP_PROBE
+    /**
+     * @brief Returns a bitmask with bit i set when bucket i of the 64-byte aligned @p group holds @p key, 0 or
+     * @p other.
+     */
+    __attribute__((always_inline))
+    static uint32_t groupMatch(std::atomic<uint64_t>* group, uint64_t key, uint64_t other) {
+#ifdef __AVX512F__
+        __m512i v = _mm512_load_si512((const void*)group);
+        return _mm512_cmpeq_epi64_mask(v, _mm512_set1_epi64(key))
+             | _mm512_cmpeq_epi64_mask(v, _mm512_setzero_si512())
+             | _mm512_cmpeq_epi64_mask(v, _mm512_set1_epi64(other));
+#else
+        __m256i k = _mm256_set1_epi64x(key);
+        __m256i z = _mm256_setzero_si256();
+        __m256i o = _mm256_set1_epi64x(other);
+        __m256i lo = _mm256_load_si256((const __m256i*)group);
+        __m256i hi = _mm256_load_si256((const __m256i*)(group + 4));
+        __m256i mlo = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi64(lo, k), _mm256_cmpeq_epi64(lo, z)), _mm256_cmpeq_epi64(lo, o));
+        __m256i mhi = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi64(hi, k), _mm256_cmpeq_epi64(hi, z)), _mm256_cmpeq_epi64(hi, o));
+        return (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(mlo))
+             | ((uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(mhi)) << 4);
+#endif
     }
+#else
+    static uint32_t groupMatch(std::atomic<uint64_t>* group, uint64_t key, uint64_t other) {
+        abort();
+    }
+#endif
 
     uint64_t insert(uint64_t key) {
         return insertOrContains<1, 0>(key, *(probeStats*)nullptr);
@@ -532,12 +1424,79 @@ public:
         return insertOrContains<0, 1>(key, ps);
     }
 
+    /**
+     * @brief Inserts the @p n keys in @p keys and writes the results to @p out, which may be @p keys itself.
+     * The bucket of each key is prefetched PREFETCH_DISTANCE keys in advance, so the cache misses of
+     * independent keys overlap instead of being taken one after another. With a 32-bit @p ID only the
+     * bucket index is kept, not the inserted flag.
+     */
+    template<typename ID>
+    void insertBatch(const uint64_t* keys, ID* out, size_t n) {
+        batch<1>(keys, out, n);
+    }
+
+    /**
+     * @brief Looks up the @p n keys in @p keys like insertBatch(), writing NotFound() for absent keys. The
+     * results are 64-bit, because NotFound() does not fit a 32-bit ID.
+     */
+    void findBatch(const uint64_t* keys, uint64_t* out, size_t n) {
+        batch<0>(keys, out, n);
+    }
+
+    template<int INSERT, typename ID>
+    void batch(const uint64_t* keys, ID* out, size_t n) {
+        static_assert(INSERT || sizeof(ID) == sizeof(uint64_t), "looking up keys needs 64-bit results to tell NotFound()");
+        uint64_t hashes[PREFETCH_DISTANCE];
+        size_t ahead = std::min(n, PREFETCH_DISTANCE);
+        for(size_t i = 0; i < ahead; ++i) {
+            hashes[i] = hash(keys[i]);
+            prefetch<INSERT>(hashes[i]);
+        }
+        for(size_t i = 0; i < n; ++i) {
+            uint64_t h = hashes[i % PREFETCH_DISTANCE];
+            if(i + PREFETCH_DISTANCE < n) {
+                uint64_t next = hash(keys[i + PREFETCH_DISTANCE]);
+                hashes[i % PREFETCH_DISTANCE] = next;
+                prefetch<INSERT>(next);
+            }
+            out[i] = insertOrContains<INSERT, 0>(keys[i], h, *(probeStats*)nullptr);
+        }
+    }
+
+    /**
+     * @brief Brings the first bucket for hash @p h into the cache. The map is read atomically, because a
+     * Rehasher may swap it; prefetching a retired map is harmless.
+     */
+    template<int INSERT>
+    __attribute__((always_inline))
+    void prefetch(uint64_t h) const {
+        std::atomic<uint64_t>* map = __atomic_load_n(&_map, __ATOMIC_RELAXED);
+        uint64_t mask = __atomic_load_n(&_entriesMask, __ATOMIC_RELAXED);
+        __builtin_prefetch(&map[h & mask], INSERT, 3);
+    }
+
     uint64_t get(uint32_t idx) {
         assert(0 <= idx);
         assert(idx < _buckets);
         return _map[idx];
     }
 
+    /**
+     * @brief Reads the keys in the @p n buckets @p idx into @p out, prefetching PREFETCH_DISTANCE buckets
+     * ahead. The buckets are read from last to first, so @p out may be @p idx itself when a level of 32-bit
+     * IDs is expanded in place into 64-bit nodes.
+     */
+    template<typename ID>
+    void getBatch(const ID* idx, uint64_t* out, size_t n) {
+        for(size_t i = n; i-- > 0 && i + PREFETCH_DISTANCE >= n;) {
+            __builtin_prefetch(&_map[idx[i]], 0, 3);
+        }
+        for(size_t i = n; i--;) {
+            if(i >= PREFETCH_DISTANCE) __builtin_prefetch(&_map[idx[i - PREFETCH_DISTANCE]], 0, 3);
+            out[i] = get(idx[i]);
+        }
+    }
+
     template<typename CONTAINER>
     mapStats getDensityStats(size_t bars, CONTAINER& elements) {
 
@@ -545,14 +1504,13 @@ public:
         size_t entriesPerBar = _buckets / bars;
         entriesPerBar += entriesPerBar == 0;
 
-        for(size_t idx = 0; idx < _buckets;) {
-            size_t elementsInThisBar = 0;
-            size_t max = std::min(_buckets, idx + entriesPerBar);
-            for(; idx < max; idx++) {
-                if(_map[idx].load(std::memory_order_relaxed)) {
-                    elementsInThisBar++;
-                }
+        std::vector<size_t> counts((_buckets + entriesPerBar - 1) / entriesPerBar);
+        parallelFor(counts.size(), _scanThreads, [&](size_t begin, size_t end, size_t) {
+            for(size_t bar = begin; bar < end; ++bar) {
+                counts[bar] = countNonZero(_map, bar * entriesPerBar, std::min(_buckets, (bar + 1) * entriesPerBar));
             }
+        });
+        for(size_t elementsInThisBar: counts) {
             entriesTotal += elementsInThisBar;
             elements.push_back(elementsInThisBar);
         }
@@ -595,15 +1553,14 @@ public:
     }
 
     mapStats getStats() {
-        std::atomic<uint64_t>* current = _map;
-        std::atomic<uint64_t>* end = _map + _buckets;
+        std::vector<size_t> counts(_scanThreads);
+        parallelFor(_buckets, _scanThreads, [&](size_t begin, size_t end, size_t part) {
+            counts[part] = countNonZero(_map, begin, end);
+        });
 
         size_t elements = 0;
-        while(current < end) {
-            if(current->load(std::memory_order_relaxed)) {
-                ++elements;
-            }
-            ++current;
+        for(size_t c: counts) {
+            elements += c;
         }
 
         _mapStats.bytesReserved = _buckets * sizeof(std::atomic<uint64_t>);
@@ -612,8 +1569,47 @@ public:
         return _mapStats;
     }
 
-    probeStats const& getProbeStats() const {
-        return _probeStats;
+    /**
+     * @brief Adds the NUMA node of up to @p samples pages of the table to @p pages, indexed by node.
+     */
+    void getNodeStats(std::vector<size_t>& pages, size_t samples = 4096) const {
+        MMapper::nodeStats(_map, _buckets * sizeof(uint64_t), samples, pages);
+    }
+
+    /**
+     * @brief Returns the probe statistics of all threads combined. Only counted with GLOBAL_TRACKING.
+     */
+    probeStats getProbeStats() const {
+        probeStats stats;
+        for(auto& s: _threadStats) {
+            stats += s.load();
+        }
+        return stats;
+    }
+
+    __attribute__((always_inline))
+    threadProbeStats& trackedStats() {
+        return _threadStats[threadSlot() & (TRACKING_SLOTS - 1)];
+    }
+
+    /**
+     * @brief Returns the histograms of all threads combined. Only recorded with GLOBAL_TRACKING >= 2.
+     */
+    probeHistograms getProbeHistograms() const {
+        probeHistograms histograms;
+        for(auto& h: _threadHistograms) {
+            histograms += h.load();
+        }
+        return histograms;
+    }
+
+    template<int INSERT>
+    __attribute__((always_inline))
+    void trackOperation(bool inserted, size_t probes, size_t failedCAS) {
+        if constexpr(GLOBAL_TRACKING >= 2) {
+            auto op = !INSERT ? probeHistograms::FIND : inserted ? probeHistograms::INSERT_NEW : probeHistograms::INSERT_EXISTING;
+            HashSetBase::trackOperation<Bucketfinder::GROUPED>(_threadHistograms[threadSlot() & (TRACKING_SLOTS - 1)], op, probes, failedCAS);
+        }
     }
 
 public:
@@ -622,28 +1618,290 @@ public:
     size_t _entriesMask;
     std::atomic<uint64_t>* _map;
     mapStats _mapStats;
-    probeStats _probeStats;
+    threadProbeStats _threadStats[GLOBAL_TRACKING ? TRACKING_SLOTS : 1];
+    threadProbeHistograms _threadHistograms[GLOBAL_TRACKING >= 2 ? TRACKING_SLOTS : 1];
+};
+
+/**
+ * @brief Hash set that grows without moving entries, so positions can be used as IDs, e.g. by dtree.
+ * It consists of segments of type HS, each twice the size of the previous one, that are added when
+ * needed. Segment i hands out the IDs [2^scale * (2^i - 1), 2^scale * (2^(i+1) - 1)).
+ *
+ * A key is stored in the first segment in which the first MAX_PROBES buckets of its probe sequence
+ * contain the key or an empty bucket. Buckets are never emptied, so once these buckets are all used
+ * they stay that way: all threads agree on the segment of a key, and a lookup can stop at the first
+ * segment that has an empty bucket in its probe window. Lookups thus consult older segments first.
+ *
+ * The probe windows only work if keys are spread evenly, so the start bucket is determined by HASH,
+ * regardless of the hash of HS. HASH should thus mix the key well.
+ *
+ * IDs are kept within 32 bits, as dtree stores two IDs per node, which limits the number of segments.
+ */
+template<typename HS, template<typename> typename HASH = HashMurmur64, size_t MAX_PROBES = 64>
+class SegmentedHashSet: public HashSetBase {
+public:
+    static constexpr size_t MAX_SEGMENTS = 32;
+
+    static_assert(!HS::RehashPolicy::RESIZES, "segments should not move entries");
+
+    SegmentedHashSet(): _scale(20), _maxSegments(12), _segments() {
+        if(HASH<uint64_t>().hash(0) != 0) {
+            printf("0 should be hashed to 0\n");
+            abort();
+        }
+        for(auto& segment: _segments) {
+            segment.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~SegmentedHashSet() {
+        for(auto& segment: _segments) {
+            delete segment.load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Sets the scale of the first segment, i.e., it holds 2^scale entries.
+     */
+    SegmentedHashSet& setScale(size_t scale) {
+        assert(scale < 32);
+        _scale = scale;
+        _maxSegments = std::min(MAX_SEGMENTS, 32 - scale);
+        return *this;
+    }
+
+    /**
+     * @brief Sets the number of threads each segment splits its scan over, see HashSetBase::setScanThreads().
+     */
+    void setScanThreads(size_t threads) {
+        HashSetBase::setScanThreads(threads);
+        forAllSegments([this](HS& segment, size_t) {
+            segment.setScanThreads(_scanThreads);
+        });
+    }
+
+    SegmentedHashSet& init() {
+        assert(!_segments[0].load(std::memory_order_relaxed) && "map already in use");
+        addSegment(0);
+        return *this;
+    }
+
+    template<int INSERT, int TRACKING>
+    uint64_t insertOrContains(uint64_t key, probeStats& ps) {
+        assert(_segments[0].load(std::memory_order_relaxed) && "storage not initialized");
+        if(!key) return 0ULL;
+        uint64_t h = HASH<uint64_t>().hash(key);
+        for(size_t i = 0; i < _maxSegments; ++i) {
+            HS* segment = _segments[i].load(std::memory_order_acquire);
+            if(!segment) {
+                if constexpr(!INSERT) return NotFound();
+                segment = addSegment(i);
+            }
+            uint64_t result = segment->template probe<INSERT, TRACKING>(segment->_map, segment->_entriesMask, std::min(MAX_PROBES, segment->_buckets), key, h, ps);
+            if(result == Full()) continue;
+            if(result == NotFound()) return result;
+            result += segmentBase(i);
+            if constexpr(INSERT) inserted(result, key);
+            return result;
+        }
+        printf("Hash map full\n");
+        exit(-1);
+        return NotFound();
+    }
+
+    uint64_t insert(uint64_t key) {
+        return insertOrContains<1, 0>(key, *(probeStats*)nullptr);
+    }
+
+    uint64_t find(uint64_t key) {
+        return insertOrContains<0, 0>(key, *(probeStats*)nullptr);
+    }
+
+    uint64_t insertTracked(uint64_t key, probeStats& ps) {
+        return insertOrContains<1, 1>(key, ps);
+    }
+
+    uint64_t findTracked(uint64_t key, probeStats& ps) {
+        return insertOrContains<0, 1>(key, ps);
+    }
+
+    /**
+     * @brief Inserts the @p n keys in @p keys and writes the results to @p out, which may be @p keys itself.
+     * A key may live in any segment, so there is no prefetching.
+     */
+    template<typename ID>
+    void insertBatch(const uint64_t* keys, ID* out, size_t n) {
+        for(size_t i = 0; i < n; ++i) out[i] = insert(keys[i]);
+    }
+
+    /**
+     * @brief Looks up the @p n keys in @p keys like insertBatch(), writing NotFound() for absent keys.
+     */
+    void findBatch(const uint64_t* keys, uint64_t* out, size_t n) {
+        for(size_t i = 0; i < n; ++i) out[i] = find(keys[i]);
+    }
+
+    uint64_t get(uint64_t idx) {
+        size_t i = 63 - __builtin_clzll((idx >> _scale) + 1);
+        HS* segment = _segments[i].load(std::memory_order_acquire);
+        assert(segment && "ID of a segment that does not exist");
+        return segment->get(idx - segmentBase(i));
+    }
+
+    /**
+     * @brief Puts @p key in the bucket of ID @p id, adding its segment if needed.
+     */
+    void restore(uint64_t id, uint64_t key, uint64_t key2) {
+        size_t i = 63 - __builtin_clzll((id >> _scale) + 1);
+        HS* segment = _segments[i].load(std::memory_order_acquire);
+        if(!segment) segment = addSegment(i);
+        segment->restore(id - segmentBase(i), key, key2);
+    }
+
+    /**
+     * @brief Reads the keys of the @p n IDs @p idx into @p out, from last to first like HashSet::getBatch().
+     */
+    template<typename ID>
+    void getBatch(const ID* idx, uint64_t* out, size_t n) {
+        for(size_t i = n; i--;) out[i] = get(idx[i]);
+    }
+
+    template<typename FUNC>
+    void forAll(FUNC&& func) {
+        forAllSegments([&func](HS& segment, size_t) {
+            segment.forAll(func);
+        });
+    }
+
+    template<typename CONTAINER>
+    mapStats getDensityStats(size_t bars, CONTAINER& elements) {
+        mapStats stats;
+        size_t buckets = 0;
+        forAllSegments([&buckets](HS& segment, size_t) {
+            buckets += segment._buckets;
+        });
+        forAllSegments([&](HS& segment, size_t) {
+            stats += segment.getDensityStats(std::max((size_t)1, bars * segment._buckets / buckets), elements);
+        });
+        return stats;
+    }
+
+    mapStats getStats() {
+        mapStats stats;
+        forAllSegments([&stats](HS& segment, size_t) {
+            stats += segment.getStats();
+        });
+        return stats;
+    }
+
+    probeStats getProbeStats() const {
+        probeStats stats;
+        for(auto& segment: _segments) {
+            HS* s = segment.load(std::memory_order_acquire);
+            if(!s) break;
+            stats += s->getProbeStats();
+        }
+        return stats;
+    }
+
+    probeHistograms getProbeHistograms() const {
+        probeHistograms histograms;
+        for(auto& segment: _segments) {
+            HS* s = segment.load(std::memory_order_acquire);
+            if(!s) break;
+            histograms += s->getProbeHistograms();
+        }
+        return histograms;
+    }
+
+    void getNodeStats(std::vector<size_t>& pages, size_t samples = 4096) const {
+        for(auto& segment: _segments) {
+            HS* s = segment.load(std::memory_order_acquire);
+            if(!s) break;
+            s->getNodeStats(pages, samples);
+        }
+    }
+
+    /**
+     * @brief Returns the pages that back the first segment.
+     */
+    MMapper::Pages getPageBacking() const {
+        HS* s = _segments[0].load(std::memory_order_acquire);
+        return s ? s->getPageBacking() : _pagePolicy;
+    }
+
+    /**
+     * @brief Returns the number of segments currently in use.
+     */
+    size_t getSegments() const {
+        size_t n = 0;
+        while(n < _maxSegments && _segments[n].load(std::memory_order_acquire)) ++n;
+        return n;
+    }
+
+protected:
+
+    uint64_t segmentBase(size_t i) const {
+        return ((1ULL << i) - 1) << _scale;
+    }
+
+    HS* addSegment(size_t i) {
+        HS* segment = new HS();
+        segment->setScale(_scale + i);
+        segment->setPagePolicy(_pagePolicy);
+        segment->setNumaPolicy(_numa);
+        segment->setPrefault(_prefault, _prefaultThreads);
+        segment->setScanThreads(_scanThreads);
+        segment->init();
+        HS* expected = nullptr;
+        if(!_segments[i].compare_exchange_strong(expected, segment, std::memory_order_acq_rel)) {
+            delete segment;
+            return expected;
+        }
+        return segment;
+    }
+
+    template<typename FUNC>
+    void forAllSegments(FUNC&& func) {
+        for(size_t i = 0; i < _maxSegments; ++i) {
+            HS* segment = _segments[i].load(std::memory_order_acquire);
+            if(!segment) break;
+            func(*segment, i);
+        }
+    }
+
+public:
+    size_t _scale;
+    size_t _maxSegments;
+    std::atomic<HS*> _segments[MAX_SEGMENTS];
 };
 
 template< template<typename> typename REHASHER
         , template<typename> typename BUCKETFINDER = QuadLinear
         , template<typename> typename HASH = HashCompare
         , int GLOBAL_TRACKING = 0
+        , int DWCAS = 0
 >
-class HashSet128: public HashSetBase, REHASHER<HashSet128<REHASHER, BUCKETFINDER, HASH, GLOBAL_TRACKING>> {
+class HashSet128: public HashSetBase, REHASHER<HashSet128<REHASHER, BUCKETFINDER, HASH, GLOBAL_TRACKING, DWCAS>> {
 public:
     static constexpr bool REPORT = 0;
     static constexpr bool REPORT_HS = 0;
+    static constexpr size_t BUCKET_WORDS = 2;
 
-    using Bucketfinder = BUCKETFINDER<HashSet128<REHASHER, BUCKETFINDER, HASH, GLOBAL_TRACKING>>;
+    using Bucketfinder = BUCKETFINDER<HashSet128<REHASHER, BUCKETFINDER, HASH, GLOBAL_TRACKING, DWCAS>>;
     friend Bucketfinder;
+
+    static_assert(!REHASHER<HashSet128<REHASHER, BUCKETFINDER, HASH, GLOBAL_TRACKING, DWCAS>>::RESIZES, "HashSet128 does not support online resizing");
+#ifndef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_16
+    static_assert(!DWCAS, "HashSet128 with DWCAS requires cmpxchg16b, compile with -mcx16");
+#endif
 public:
 
 //    HashSet(): _scale(0), _buckets(0), _entriesMask(0), _map(nullptr) {
 //    }
 
     HashSet128(): _scale(28), _buckets(1ULL << _scale), _entriesMask(_buckets - 1), _map(nullptr) {
-        if(HASH<uint64_t>().hash(0) != 0) {
+        if(HASH<unsigned __int128>().hash(0) != 0) {
             printf("0 should be hashed to 0\n");
             abort();
         }
@@ -663,16 +1921,57 @@ public:
 
     HashSet128& init() {
         assert(!_map && "map already in use");
-        _map = (decltype(_map))mmap(nullptr, _buckets * sizeof(uint64_t) * 2, PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
-        assert(_map && "failed to mmap data");
+        _map = (decltype(_map))mapTable(_buckets * sizeof(uint64_t) * 2);
+        return *this;
+    }
+
+    /**
+     * @brief The table, for Snapshot.
+     */
+    const void* getTable() const {
+        return _map;
+    }
+
+    size_t getTableBytes() const {
+        return _buckets * sizeof(uint64_t) * 2;
+    }
+
+    /**
+     * @brief Identifies the hash function, the bucket finder and the bucket layout, so a Snapshot is not
+     * opened by a hash set that places or stores elements differently.
+     */
+    uint64_t getHashCheck() const {
+        uint64_t check = HASH<unsigned __int128>().hash(((unsigned __int128)0xFEDCBA9876543210ULL << 64) | 0x0123456789ABCDEFULL);
+        check ^= getProbeCheck<Bucketfinder>(const_cast<HashSet128&>(*this));
+        return check ^ ((uint64_t)BUCKET_WORDS << 56) ^ ((uint64_t)DWCAS << 48);
+    }
+
+    /**
+     * @brief Uses the table of @p bytes at @p map, e.g., mapped from a Snapshot, instead of init().
+     * @param backing The pages that back @p map.
+     */
+    HashSet128& adoptTable(void* map, size_t bytes, MMapper::Pages backing = MMapper::Pages::SMALL) {
+        assert(!_map && "map already in use");
+        setScale(__builtin_ctzll(bytes / sizeof(uint64_t) / 2));
+        _map = (decltype(_map))map;
+        _pageBacking.store(backing, std::memory_order_relaxed);
         return *this;
     }
 
+    /**
+     * @brief Puts @p key and @p key2 in bucket @p id, e.g., when replaying a WriteAheadLog.
+     */
+    void restore(uint64_t id, uint64_t key, uint64_t key2) {
+        assert(id < _buckets);
+        _map[id*2+1].store(key2, std::memory_order_relaxed);
+        _map[id*2].store(key, std::memory_order_relaxed);
+    }
+
+    /**
+     * Hashes the full 128-bit key. HashCompare only uses @c key, the other HASH policies mix in @c key2.
+     */
     uint64_t entry(uint64_t key, uint64_t key2) {
-//        uint32_t h = MurmurHash64(key);
-//        uint32_t h = MurmurHash64(&key, sizeof(size_t), seedForZero);
-//        uint64_t h = HASH<__int128>().hash( ((__int128)key) | (((__int128)key2) << 64));
-        uint64_t h = HASH<uint64_t>().hash(key);
+        uint64_t h = HASH<unsigned __int128>().hash(((unsigned __int128)key2 << 64) | key);
         return h & _entriesMask;
     }
 
@@ -704,10 +2003,49 @@ public:
             ps.probeCount = 1;
             ps.failedCAS = 0;
         }
-        if(GLOBAL_TRACKING) _probeStats.probeCount++;
+        if(GLOBAL_TRACKING) track(trackedStats().probeCount, 1);
         std::atomic<uint64_t>* current = &_map[e*2];
 
         size_t probeCount = 1;
+        size_t failedCAS = 0;
+
+        if constexpr(DWCAS) {
+            unsigned __int128 desired = ((unsigned __int128)key2 << 64) | key;
+            while(probeCount < _buckets) {
+                unsigned __int128 k = load128(e);
+                if(k == 0 && e != 0) {
+                    if constexpr(!INSERT) {
+                        if(GLOBAL_TRACKING) track(trackedStats().finds, 1);
+                        trackOperation<INSERT>(false, probeCount, failedCAS);
+                        return NotFound();
+                    }
+                    k = cas128(e, 0, desired);
+                    if(k == 0) {
+                        if(REPORT) printf("\033[31mMapped %16zx|%16zx -> %16zx\033[0m\n", key, key2, e);
+                        if(GLOBAL_TRACKING) track(trackedStats().insertsNew, 1);
+                        trackOperation<INSERT>(true, probeCount, failedCAS);
+                        inserted(newlyInserted(e), key, key2);
+                        return newlyInserted(e);
+                    }
+                    if(TRACKING) ps.failedCAS++;
+                    failedCAS++;
+                    if(GLOBAL_TRACKING) track(trackedStats().failedCAS, 1);
+                }
+                if(k == desired) {
+                    if(REPORT) printf("\033[31mUsed   %16zx|%16zx -> %16zx\033[0m\n", key, key2, e);
+                    if(GLOBAL_TRACKING) track(trackedStats().insertsExisting, 1);
+                    trackOperation<INSERT>(false, probeCount, failedCAS);
+                    return e;
+                }
+                searcher.next();
+                if(TRACKING) ps.probeCount++;
+                if(GLOBAL_TRACKING) track(trackedStats().probeCount, 1);
+                probeCount++;
+            }
+            printf("Hash map full\n");
+            exit(-1);
+            return NotFound();
+        }
 
 //        size_t maxProbes = _buckets / 8;
 
@@ -719,7 +2057,8 @@ public:
                 if(e == 0) goto findnext;
                 if constexpr(!INSERT) {
                     if(REPORT) printf("\033[31mNo such mapping %16zx|%16zx -> ?\033[0m\n", key, key2);
-                    if(GLOBAL_TRACKING) _probeStats.finds++;
+                    if(GLOBAL_TRACKING) track(trackedStats().finds, 1);
+                    trackOperation<INSERT>(false, probeCount, failedCAS);
                     return NotFound();
                 }
                 if(current->compare_exchange_strong(k, key, std::memory_order_release, std::memory_order_relaxed)) {
@@ -727,11 +2066,14 @@ public:
                     //std::atomic_thread_fence(std::memory_order_release); // this should be a flush on ARM
                     if(REPORT_HS) printf("  inserted\n");
                     if(REPORT) printf("\033[31mMapped %16zx|%16zx -> %16zx\033[0m\n", key, key2, e);
-                    if(GLOBAL_TRACKING) _probeStats.insertsNew++;
+                    if(GLOBAL_TRACKING) track(trackedStats().insertsNew, 1);
+                    trackOperation<INSERT>(true, probeCount, failedCAS);
+                    inserted(newlyInserted(e), key, key2);
                     return newlyInserted(e);
                 } else {
                     if(TRACKING) ps.failedCAS++;
-                    if(GLOBAL_TRACKING) _probeStats.failedCAS++;
+                    failedCAS++;
+                    if(GLOBAL_TRACKING) track(trackedStats().failedCAS, 1);
                 }
             }
             if(k == key) {
@@ -752,14 +2094,15 @@ public:
                 if(k2 == key2) {
                     if(REPORT) printf("\033[31mUsed   %16zx|%16zx -> %16zx\033[0m\n", key, key2, e);
                     if(REPORT_HS) printf("  found\n");
-                    if(GLOBAL_TRACKING) _probeStats.insertsExisting++;
+                    if(GLOBAL_TRACKING) track(trackedStats().insertsExisting, 1);
+                    trackOperation<INSERT>(false, probeCount, failedCAS);
                     return e;
                 }
             }
             findnext:
             searcher.next();
             if(TRACKING) ps.probeCount++;
-            if(GLOBAL_TRACKING) _probeStats.probeCount++;
+            if(GLOBAL_TRACKING) track(trackedStats().probeCount, 1);
             current = &_map[e*2];
             probeCount++;
         }
@@ -797,12 +2140,20 @@ public:
     __int128 get(uint64_t idx) {
         assert(0 <= idx);
         assert(idx < _buckets);
+        if constexpr(DWCAS) {
+            return load128(idx);
+        }
         return ((__int128*)_map)[idx];
     }
 
     uint64_t get(uint64_t idx, uint64_t& key2) {
         assert(0 <= idx);
         assert(idx < _buckets);
+        if constexpr(DWCAS) {
+            unsigned __int128 k = load128(idx);
+            key2 = k >> 64;
+            return (uint64_t)k;
+        }
         size_t idx2 = idx * 2;
         uint64_t key = _map[idx2].load(std::memory_order_relaxed);
         key2 = _map[idx2 + 1].load(std::memory_order_relaxed);;
@@ -833,14 +2184,14 @@ public:
         size_t entriesPerBar = _buckets / bars;
         entriesPerBar += entriesPerBar == 0;
 
-        for(size_t idx = 0; idx < _buckets;) {
-            size_t elementsInThisBar = 0;
-            size_t max = std::min(_buckets, idx + entriesPerBar);
-            for(; idx < max; idx += 2) {
-                if(_map[idx].load(std::memory_order_relaxed)) {
-                    elementsInThisBar++;
-                }
+        // Bars are counted in buckets, each bucket is 2 words
+        std::vector<size_t> counts((_buckets + entriesPerBar - 1) / entriesPerBar);
+        parallelFor(counts.size(), _scanThreads, [&](size_t begin, size_t end, size_t) {
+            for(size_t bar = begin; bar < end; ++bar) {
+                counts[bar] = countNonZero<2>(_map, bar * entriesPerBar * 2, std::min(_buckets, (bar + 1) * entriesPerBar) * 2);
             }
+        });
+        for(size_t elementsInThisBar: counts) {
             entriesTotal += elementsInThisBar;
             elements.push_back(elementsInThisBar);
         }
@@ -874,15 +2225,14 @@ public:
     }
 
     mapStats getStats() {
-        std::atomic<uint64_t>* current = _map;
-        std::atomic<uint64_t>* end = _map + _buckets * 2;
+        std::vector<size_t> counts(_scanThreads);
+        parallelFor(_buckets, _scanThreads, [&](size_t begin, size_t end, size_t part) {
+            counts[part] = countNonZero<2>(_map, begin * 2, end * 2);
+        });
 
         size_t elements = 0;
-        while(current < end) {
-            if(current->load(std::memory_order_relaxed)) {
-                ++elements;
-            }
-            current += 2;
+        for(size_t c: counts) {
+            elements += c;
         }
 
         _mapStats.bytesReserved = _buckets * sizeof(std::atomic<uint64_t>) * 2;
@@ -891,8 +2241,83 @@ public:
         return _mapStats;
     }
 
-    probeStats const& getProbeStats() const {
-        return _probeStats;
+    /**
+     * @brief Adds the NUMA node of up to @p samples pages of the table to @p pages, indexed by node.
+     */
+    void getNodeStats(std::vector<size_t>& pages, size_t samples = 4096) const {
+        MMapper::nodeStats(_map, _buckets * sizeof(uint64_t) * 2, samples, pages);
+    }
+
+    /**
+     * @brief Returns the probe statistics of all threads combined. Only counted with GLOBAL_TRACKING.
+     */
+    probeStats getProbeStats() const {
+        probeStats stats;
+        for(auto& s: _threadStats) {
+            stats += s.load();
+        }
+        return stats;
+    }
+
+    __attribute__((always_inline))
+    threadProbeStats& trackedStats() {
+        return _threadStats[threadSlot() & (TRACKING_SLOTS - 1)];
+    }
+
+    /**
+     * @brief Returns the histograms of all threads combined. Only recorded with GLOBAL_TRACKING >= 2.
+     */
+    probeHistograms getProbeHistograms() const {
+        probeHistograms histograms;
+        for(auto& h: _threadHistograms) {
+            histograms += h.load();
+        }
+        return histograms;
+    }
+
+    template<int INSERT>
+    __attribute__((always_inline))
+    void trackOperation(bool inserted, size_t probes, size_t failedCAS) {
+        if constexpr(GLOBAL_TRACKING >= 2) {
+            auto op = !INSERT ? probeHistograms::FIND : inserted ? probeHistograms::INSERT_NEW : probeHistograms::INSERT_EXISTING;
+            HashSetBase::trackOperation<Bucketfinder::GROUPED>(_threadHistograms[threadSlot() & (TRACKING_SLOTS - 1)], op, probes, failedCAS);
+        }
+    }
+
+protected:
+
+    /**
+     * @brief Loads both words of bucket @p idx at once. Aligned 16-byte loads are atomic on CPUs with AVX.
+     * Without AVX, the words are loaded one by one: a bucket is filled by a single cas128() and never
+     * changes after, so once the first word is seen non-zero, the second is already there. Only a zero
+     * first word, an empty bucket or one with a zero key, needs a compare-and-swap that never changes it.
+     */
+    __attribute__((always_inline))
+    unsigned __int128 load128(uint64_t idx) const {
+#ifdef __AVX__
+        unsigned __int128* p = (unsigned __int128*)&_map[idx * 2];
+        // volatile keeps the compiler from splitting this into two 8-byte loads
+        __m128i v = *(volatile __m128i*)p;
+        return ((unsigned __int128)(uint64_t)_mm_extract_epi64(v, 1) << 64) | (uint64_t)_mm_cvtsi128_si64(v);
+#else
+        uint64_t key = _map[idx * 2].load(std::memory_order_acquire);
+        if(key) {
+            return ((unsigned __int128)_map[idx * 2 + 1].load(std::memory_order_relaxed) << 64) | key;
+        }
+        return cas128(idx, 0, 0);
+#endif
+    }
+
+    /**
+     * @brief Double-width compare-and-swap on bucket @p idx. Returns the previous contents.
+     */
+    __attribute__((always_inline))
+    unsigned __int128 cas128(uint64_t idx, unsigned __int128 expected, unsigned __int128 desired) const {
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_16
+        return __sync_val_compare_and_swap((unsigned __int128*)&_map[idx * 2], expected, desired);
+#else
+        abort();
+#endif
     }
 
 public:
@@ -901,5 +2326,17 @@ public:
     size_t _entriesMask;
     std::atomic<uint64_t>* _map;
     mapStats _mapStats;
-    probeStats _probeStats;
-};
\ No newline at end of file
+    threadProbeStats _threadStats[GLOBAL_TRACKING ? TRACKING_SLOTS : 1];
+    threadProbeHistograms _threadHistograms[GLOBAL_TRACKING >= 2 ? TRACKING_SLOTS : 1];
+};
+
+/**
+ * @brief HashSet128 that publishes both words of a bucket with a single cmpxchg16b, so readers never wait
+ * for the second word. Requires -mcx16.
+ */
+template< template<typename> typename REHASHER
+        , template<typename> typename BUCKETFINDER = QuadLinear
+        , template<typename> typename HASH = HashCompare
+        , int GLOBAL_TRACKING = 0
+>
+using HashSet128DWCAS = HashSet128<REHASHER, BUCKETFINDER, HASH, GLOBAL_TRACKING, 1>;
\ No newline at end of file
@@ -0,0 +1,325 @@
+/*
+ * Dtree - a concurrent compression tree for variable-length vectors
+ * Copyright © 2018-2021 Freark van der Berg
+ *
+ * This file is part of Dtree.
+ *
+ * Dtree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Dtree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Dtree.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#   define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#   define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#   define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MADV_POPULATE_WRITE
+#   define MADV_POPULATE_WRITE 23
+#endif
+
+/**
+ * @brief Maps the zeroed memory of hash set tables, optionally backed by huge pages to reduce the TLB
+ * misses of random probes in large tables.
+ *
+ * A policy names the largest page size to try. Mapping falls back to the next smaller page size when a
+ * page size is not available, e.g., when the hugetlbfs pool is too small or the table is smaller than a
+ * page, down to regular pages. The Pages obtained are returned as well.
+ *
+ * Mappings always span exactly the requested number of bytes, so they can be released with munmap() of
+ * the same size regardless of their backing.
+ *
+ * A NUMA policy places the pages of a mapping on the nodes of a multi-socket machine, instead of on the
+ * node of the thread that first touches each page. It is applied with the mbind system call before any
+ * page is touched, so it does not need libnuma. A placement the kernel refuses, e.g., because of a
+ * nonexistent node, leaves the first-touch default in place.
+ *
+ * Mappings are lazily backed by default, so the first inserts into a fresh table spend most of their time
+ * in page faults, which serialize on the memory map lock of the process. A prefault mode backs the whole
+ * mapping up front instead.
+ */
+class MMapper {
+public:
+
+    enum class Pages {
+        SMALL,          // Regular pages
+        TRANSPARENT,    // Regular mapping advised with MADV_HUGEPAGE, aligned to 2 MiB
+        HUGETLB_2M,     // MAP_HUGETLB with 2 MiB pages, which requires a hugetlbfs pool
+        HUGETLB_1G,     // MAP_HUGETLB with 1 GiB pages, which requires a hugetlbfs pool
+    };
+
+    /**
+     * @brief Placement of the pages of a mapping over NUMA nodes. The values are the MPOL_* modes of mbind.
+     */
+    enum class Numa {
+        DEFAULT = 0,    // First touch
+        PREFERRED = 1,  // On node if possible, elsewhere otherwise
+        BIND = 2,       // Only on node
+        INTERLEAVE = 3, // Round-robin over all nodes with memory
+    };
+
+    struct NumaPolicy {
+        constexpr NumaPolicy(Numa placement = Numa::DEFAULT, int node = 0): placement(placement), node(node) {}
+
+        Numa placement;
+        int node;       // Node of PREFERRED and BIND
+    };
+
+    /**
+     * @brief How the pages of a mapping are backed before it is used.
+     */
+    enum class Prefault {
+        LAZY,           // On first touch
+        POPULATE,       // By the kernel with MADV_POPULATE_WRITE, falling back to TOUCH on older kernels
+        TOUCH,          // By threads that each write to a range of pages, striping the ranges over the nodes
+    };
+
+    static constexpr size_t MAX_NODES = 1024;
+
+    static constexpr size_t HUGE_2M = 1ULL << 21;
+    static constexpr size_t HUGE_1G = 1ULL << 30;
+
+    static size_t pageSize(Pages pages) {
+        switch(pages) {
+            case Pages::HUGETLB_2M: return HUGE_2M;
+            case Pages::HUGETLB_1G: return HUGE_1G;
+            default: return 4096;
+        }
+    }
+
+    static const char* name(Pages pages) {
+        switch(pages) {
+            case Pages::SMALL: return "small pages";
+            case Pages::TRANSPARENT: return "transparent huge pages";
+            case Pages::HUGETLB_2M: return "hugetlb 2 MiB pages";
+            case Pages::HUGETLB_1G: return "hugetlb 1 GiB pages";
+        }
+        return "?";
+    }
+
+    /**
+     * @brief Maps @p bytes of zeroed memory, using pages no larger than @p policy allows.
+     * @param obtained Set to the backing that was obtained.
+     * @return The mapping, or nullptr if not even regular pages could be mapped.
+     */
+    static void* mmapForMap(size_t bytes, Pages policy, Pages& obtained, NumaPolicy numa = NumaPolicy()) {
+        void* map = mmapPages(bytes, policy, obtained);
+        if(map && numa.placement != Numa::DEFAULT) {
+            place(map, bytes, numa);
+        }
+        return map;
+    }
+
+    static void* mmapPages(size_t bytes, Pages policy, Pages& obtained) {
+        void* map;
+        if(policy >= Pages::HUGETLB_1G && (map = mmapHugetlb(bytes, HUGE_1G, MAP_HUGE_1GB))) {
+            obtained = Pages::HUGETLB_1G;
+            return map;
+        }
+        if(policy >= Pages::HUGETLB_2M && (map = mmapHugetlb(bytes, HUGE_2M, MAP_HUGE_2MB))) {
+            obtained = Pages::HUGETLB_2M;
+            return map;
+        }
+        if(policy >= Pages::TRANSPARENT && (map = mmapTransparent(bytes))) {
+            obtained = Pages::TRANSPARENT;
+            return map;
+        }
+        map = mmap(nullptr, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        obtained = Pages::SMALL;
+        return map == MAP_FAILED ? nullptr : map;
+    }
+
+    /**
+     * @brief Maps @p bytes with hugetlb pages of @p pageSize bytes. This does not use MAP_NORESERVE, so the
+     * pages are reserved up front and an exhausted pool makes the mmap fail instead of a later page fault.
+     * @return The mapping, or nullptr if @p bytes is not a multiple of @p pageSize or the pool is too small.
+     */
+    static void* mmapHugetlb(size_t bytes, size_t pageSize, int sizeFlag) {
+        if(bytes < pageSize || (bytes & (pageSize - 1))) return nullptr;
+        void* map = mmap(nullptr, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | sizeFlag, -1, 0);
+        return map == MAP_FAILED ? nullptr : map;
+    }
+
+    /**
+     * @brief Maps @p bytes aligned to 2 MiB and advises the kernel to back it with transparent huge pages.
+     * @return The mapping, or nullptr if @p bytes is smaller than a huge page or transparent huge pages are
+     * disabled.
+     */
+    static void* mmapTransparent(size_t bytes) {
+        if(bytes < HUGE_2M || !transparentEnabled()) return nullptr;
+
+        // Map a huge page more and trim both ends to get a 2 MiB aligned mapping of exactly bytes
+        char* map = (char*)mmap(nullptr, bytes + HUGE_2M, PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(map == MAP_FAILED) return nullptr;
+        char* aligned = (char*)(((uintptr_t)map + HUGE_2M - 1) & ~(uintptr_t)(HUGE_2M - 1));
+        if(aligned > map) munmap(map, aligned - map);
+        if(map + HUGE_2M > aligned) munmap(aligned + bytes, map + HUGE_2M - aligned);
+
+        if(madvise(aligned, bytes, MADV_HUGEPAGE)) {
+            munmap(aligned, bytes);
+            return nullptr;
+        }
+        return aligned;
+    }
+
+    /**
+     * @brief Backs the @p bytes at @p map, which must be zero, according to @p mode, using up to @p threads
+     * threads; 0 means one per hardware thread. @p backing is the page size the mapping was obtained with.
+     *
+     * With TOUCH, the mapping is split into one range per thread. With a first-touch @p numa on a machine
+     * with several nodes, the touching threads are not pinned, so instead each range is preferred to a node
+     * with memory, round-robin, while it is touched. The table is thus striped over the nodes rather than
+     * placed on the node of the caller. The ranges are reset to first touch afterwards, so pages the kernel
+     * backs later, e.g., after reclaim, follow first touch again. A @p numa other than first touch already
+     * placed the mapping and is left in place.
+     */
+    static void prefault(void* map, size_t bytes, Pages backing, Prefault mode, size_t threads, NumaPolicy numa = NumaPolicy()) {
+        if(mode == Prefault::LAZY || !map || !bytes) return;
+        if(mode == Prefault::POPULATE && !madvise(map, bytes, MADV_POPULATE_WRITE)) return;
+
+        size_t page = pageSize(backing);
+        size_t pages = (bytes + page - 1) / page;
+        if(!threads) threads = std::max(1U, std::thread::hardware_concurrency());
+        threads = std::min(threads, pages);
+        std::vector<int> nodes;
+        if(numa.placement == Numa::DEFAULT) onlineNodes(nodes);
+
+        auto touch = [=, &nodes](size_t t) {
+            char* begin = (char*)map + pages * t / threads * page;
+            char* end = (char*)map + std::min(bytes, pages * (t + 1) / threads * page);
+            if(nodes.size() > 1) {
+                place(begin, end - begin, NumaPolicy(Numa::PREFERRED, nodes[t % nodes.size()]));
+            }
+            for(volatile char* p = begin; p < end; p += page) {
+                *p = 0;
+            }
+            if(nodes.size() > 1) {
+                place(begin, end - begin, NumaPolicy());
+            }
+        };
+        std::vector<std::thread> workers;
+        for(size_t t = 1; t < threads; ++t) {
+            workers.emplace_back(touch, t);
+        }
+        touch(0);
+        for(auto& w: workers) {
+            w.join();
+        }
+    }
+
+    /**
+     * @brief Applies @p numa to the @p bytes at @p map, which must be page aligned.
+     * @return Whether the kernel accepted the placement.
+     */
+    static bool place(void* map, size_t bytes, NumaPolicy numa) {
+        unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {};
+        if(numa.placement == Numa::INTERLEAVE) {
+            std::vector<int> nodes;
+            onlineNodes(nodes);
+            for(int n: nodes) {
+                if(n < (int)MAX_NODES) mask[n / (8 * sizeof(unsigned long))] |= 1UL << (n % (8 * sizeof(unsigned long)));
+            }
+        } else if(numa.placement != Numa::DEFAULT) {
+            if(numa.node < 0 || numa.node >= (int)MAX_NODES) return false;
+            mask[numa.node / (8 * sizeof(unsigned long))] |= 1UL << (numa.node % (8 * sizeof(unsigned long)));
+        }
+        return syscall(SYS_mbind, map, bytes, (int)numa.placement, numa.placement == Numa::DEFAULT ? nullptr : mask, MAX_NODES + 1, 0) == 0;
+    }
+
+    /**
+     * @brief Writes the NUMA nodes with memory to @p nodes. Without NUMA support, that is only node 0.
+     */
+    static void onlineNodes(std::vector<int>& nodes) {
+        nodes.clear();
+        FILE* f = fopen("/sys/devices/system/node/has_memory", "r");
+        if(!f) f = fopen("/sys/devices/system/node/online", "r");
+        if(f) {
+            int first, last;
+            char separator = ',';
+            while(separator == ',' && fscanf(f, "%d", &first) == 1) {
+                last = first;
+                if(fscanf(f, "%c", &separator) == 1 && separator == '-') {
+                    if(fscanf(f, "%d", &last) != 1) break;
+                    if(fscanf(f, "%c", &separator) != 1) separator = 0;
+                }
+                for(int n = first; n <= last; ++n) {
+                    nodes.push_back(n);
+                }
+            }
+            fclose(f);
+        }
+        if(nodes.empty()) nodes.push_back(0);
+    }
+
+    /**
+     * @brief Returns the NUMA node of the CPU the calling thread runs on.
+     */
+    static int currentNode() {
+        unsigned cpu = 0;
+        unsigned node = 0;
+        if(syscall(SYS_getcpu, &cpu, &node, nullptr)) return 0;
+        return node;
+    }
+
+    /**
+     * @brief Adds the node of up to @p samples evenly spread pages of the @p bytes at @p map to @p pages,
+     * indexed by node. Pages that were never touched are not counted.
+     */
+    static void nodeStats(const void* map, size_t bytes, size_t samples, std::vector<size_t>& pages) {
+        size_t pageSize = 4096;
+        size_t stride = std::max(pageSize, (bytes / std::max(samples, (size_t)1)) & ~(pageSize - 1));
+        std::vector<void*> addresses;
+        for(size_t offset = 0; offset < bytes; offset += stride) {
+            addresses.push_back((char*)map + offset);
+        }
+        std::vector<int> status(addresses.size());
+        if(syscall(SYS_move_pages, 0, addresses.size(), addresses.data(), nullptr, status.data(), 0)) return;
+        for(int node: status) {
+            if(node < 0) continue;
+            if((size_t)node >= pages.size()) pages.resize(node + 1);
+            pages[node]++;
+        }
+    }
+
+    /**
+     * @brief Returns whether the kernel hands out transparent huge pages to madvised mappings.
+     */
+    static bool transparentEnabled() {
+        static const bool enabled = []() {
+            FILE* f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+            if(!f) return false;
+            char buffer[128] = {};
+            size_t n = fread(buffer, 1, sizeof(buffer) - 1, f);
+            fclose(f);
+            buffer[n] = 0;
+            return strstr(buffer, "[never]") == nullptr;
+        }();
+        return enabled;
+    }
+};
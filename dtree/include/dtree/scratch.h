@@ -0,0 +1,162 @@
+/*
+ * Dtree - a concurrent compression tree for variable-length vectors
+ * Copyright © 2018-2021 Freark van der Berg
+ *
+ * This file is part of Dtree.
+ *
+ * Dtree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Dtree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Dtree.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * @brief Stack-like memory for the temporaries of tree operations, such as the level buffers of
+ * deconstruct(), so their size is not limited by the stack of the calling thread.
+ *
+ * Memory is taken from blocks of at least BLOCK_SIZE bytes, which are kept when released, so after the first
+ * few operations no memory is allocated anymore. Allocations are aligned to ALIGNMENT bytes, a cache line, so
+ * buffers of leaves can be loaded with aligned vector loads. Memory is taken within a Frame and released when
+ * the Frame ends, in reverse order.
+ *
+ * An arena is used by one thread at a time. Tree operations use local(), which is an arena owned by the
+ * calling thread, unless the caller provides its own arena for a while through a Scope.
+ */
+class ScratchArena {
+public:
+    static constexpr size_t ALIGNMENT = 64;
+    static constexpr size_t BLOCK_SIZE = 1ULL << 16;
+
+    /**
+     * @brief Releases all memory taken from the arena through it when it goes out of scope.
+     */
+    class Frame {
+    public:
+        explicit Frame(ScratchArena& arena): _arena(arena), _block(arena._block), _used(arena._used) {}
+
+        Frame(Frame const&) = delete;
+        Frame& operator=(Frame const&) = delete;
+
+        ~Frame() {
+            _arena._block = _block;
+            _arena._used = _used;
+        }
+
+        /**
+         * @brief Takes room for @p n elements of type T, uninitialized.
+         */
+        template<typename T>
+        T* alloc(size_t n) {
+            return _arena.alloc<T>(n);
+        }
+
+    private:
+        ScratchArena& _arena;
+        size_t _block;
+        size_t _used;
+    };
+
+    /**
+     * @brief Makes local() return @p arena on the calling thread until the Scope ends.
+     */
+    class Scope {
+    public:
+        explicit Scope(ScratchArena& arena): _previous(current()) {
+            current() = &arena;
+        }
+
+        Scope(Scope const&) = delete;
+        Scope& operator=(Scope const&) = delete;
+
+        ~Scope() {
+            current() = _previous;
+        }
+
+    private:
+        ScratchArena* _previous;
+    };
+
+public:
+    ScratchArena(): _block(0), _used(0) {}
+
+    ScratchArena(ScratchArena const&) = delete;
+    ScratchArena& operator=(ScratchArena const&) = delete;
+
+    ~ScratchArena() {
+        for(Block& b: _blocks) free(b.data);
+    }
+
+    /**
+     * @brief The arena of the calling thread: the one of the innermost Scope, or else one of its own.
+     */
+    __attribute__((always_inline))
+    static ScratchArena& local() {
+        return *current();
+    }
+
+    /**
+     * @brief The number of bytes held by the arena, in use or not.
+     */
+    size_t getCapacity() const {
+        size_t capacity = 0;
+        for(Block const& b: _blocks) capacity += b.size;
+        return capacity;
+    }
+
+private:
+    static ScratchArena*& current() {
+        static thread_local ScratchArena own;
+        static thread_local ScratchArena* arena = &own;
+        return arena;
+    }
+
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    template<typename T>
+    T* alloc(size_t n) {
+        size_t bytes = (n * sizeof(T) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        for(; _block < _blocks.size(); ++_block, _used = 0) {
+            Block& b = _blocks[_block];
+            if(_used + bytes <= b.size) {
+                T* p = (T*)(b.data + _used);
+                _used += bytes;
+                return p;
+            }
+        }
+        size_t size = std::max(BLOCK_SIZE, bytes);
+        char* data = (char*)aligned_alloc(ALIGNMENT, size);
+        if(!data) {
+            printf("Could not allocate %zu bytes of scratch memory\n", size);
+            exit(-1);
+        }
+        _blocks.push_back(Block{data, size});
+        _block = _blocks.size() - 1;
+        _used = bytes;
+        return (T*)_blocks.back().data;
+    }
+
+private:
+    std::vector<Block> _blocks;
+    size_t _block;
+    size_t _used;
+};
@@ -0,0 +1,416 @@
+/*
+ * Dtree - a concurrent compression tree for variable-length vectors
+ * Copyright © 2018-2021 Freark van der Berg
+ *
+ * This file is part of Dtree.
+ *
+ * Dtree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Dtree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Dtree.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * @brief Saves the tables of hash sets to a file and maps them back, so the Indices of a tree stay valid
+ * across processes.
+ *
+ * A snapshot consists of a header followed by the tables, each at an offset aligned to ALIGNMENT. Tables
+ * are written as they are in memory, so opening a snapshot maps the tables of the file directly: nothing is
+ * read until it is probed, and pages are only read from the file on first access. The mappings are private,
+ * so inserts after opening copy the pages they modify and never change the file; save() again to checkpoint.
+ *
+ * Runs of zeroed pages are not written, which leaves holes in the file on file systems that support sparse
+ * files. A snapshot is first written next to @c path and then renamed over it, so an interrupted save never
+ * destroys the previous snapshot.
+ *
+ * A compact snapshot, written by saveCompact(), only holds the occupied buckets, so its size is proportional
+ * to the number of nodes instead of the capacity of the tables. A table is split in blocks of BLOCK_BUCKETS
+ * buckets, each of which encodes its occupied buckets in order: the distance to the previous occupied bucket,
+ * followed by the two 32-bit halves of every word of the bucket, all as LEB128 varints. Blocks are encoded
+ * and decoded independently by multiple threads, through an index of their file offsets. openCompact() maps
+ * fresh tables and writes every bucket back to its position, so Indices remain valid as well.
+ *
+ * The hash sets need to provide getTable(), getTableBytes(), getHashCheck(), adoptTable(), mapTable(),
+ * BUCKET_WORDS and parallelFor(). Snapshots are only portable between builds with the same hash set types,
+ * which the hash check, covering the hash function, bucket finder and bucket layout, and the table sizes guard.
+ */
+class Snapshot {
+public:
+    static constexpr uint64_t MAGIC = 0x31504E5345455254ULL; // "TREESNP1"
+    static constexpr uint64_t COMPACT_MAGIC = 0x31504D4345455254ULL; // "TREECMP1"
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t MAX_TABLES = 8;
+    static constexpr size_t ALIGNMENT = 1ULL << 16;
+    static constexpr size_t BLOCK_BUCKETS = 1ULL << 16;
+
+    struct Table {
+        uint64_t bytes;
+        uint64_t offset;
+        uint64_t hashCheck;
+    };
+
+    struct Header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t tables;
+        uint64_t flags;
+        Table table[MAX_TABLES];
+    };
+
+    /**
+     * @brief Writes the tables of @p sets to a snapshot at @p path. No thread may modify the sets meanwhile.
+     * @param flags Stored along, for state outside the tables.
+     * @return Whether the snapshot was written; the reason is printed otherwise.
+     */
+    template<typename... SETS>
+    static bool save(const char* path, uint64_t flags, SETS const&... sets) {
+        static_assert(sizeof...(SETS) <= MAX_TABLES, "too many tables");
+        Header header = {};
+        header.magic = MAGIC;
+        header.version = VERSION;
+        header.tables = sizeof...(SETS);
+        header.flags = flags;
+        uint64_t offset = align(sizeof(Header));
+        size_t t = 0;
+        ((header.table[t++] = {sets.getTableBytes(), 0, sets.getHashCheck()}), ...);
+        for(t = 0; t < header.tables; ++t) {
+            header.table[t].offset = offset;
+            offset += align(header.table[t].bytes);
+        }
+
+        std::string temporary = std::string(path) + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            printf("Could not create snapshot %s\n", temporary.c_str());
+            return false;
+        }
+        bool ok = writeAll(fd, 0, &header, sizeof(header)) && ftruncate(fd, offset) == 0;
+        t = 0;
+        ((ok = ok && writeTable(fd, header.table[t++], sets.getTable())), ...);
+        ok = ok && fsync(fd) == 0;
+        ok = (::close(fd) == 0) && ok;
+        if(!ok || rename(temporary.c_str(), path)) {
+            printf("Could not write snapshot %s\n", path);
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Maps the tables of the snapshot at @p path into @p sets, instead of init(). The sets need to be
+     * of the types the snapshot was saved from, in the same order.
+     * @param flags Set to the flags the snapshot was saved with.
+     * @return Whether the snapshot was opened; the reason is printed otherwise and the sets are untouched.
+     */
+    template<typename... SETS>
+    static bool open(const char* path, uint64_t& flags, SETS&... sets) {
+        int fd = ::open(path, O_RDONLY);
+        if(fd < 0) {
+            printf("Could not open snapshot %s\n", path);
+            return false;
+        }
+        Header header;
+        off_t size = lseek(fd, 0, SEEK_END);
+        bool ok = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+        ok = ok && header.magic == MAGIC && header.version == VERSION && header.tables == sizeof...(SETS);
+        size_t t = 0;
+        ((ok = ok && header.table[t].hashCheck == sets.getHashCheck() && fits(header.table[t], size), t++), ...);
+        if(!ok) {
+            printf("Not a compatible snapshot: %s\n", path);
+            ::close(fd);
+            return false;
+        }
+
+        void* maps[sizeof...(SETS)];
+        for(t = 0; t < header.tables; ++t) {
+            maps[t] = mmap(nullptr, header.table[t].bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, header.table[t].offset);
+            if(maps[t] == MAP_FAILED) {
+                printf("Could not map table %zu of snapshot %s\n", t, path);
+                while(t--) munmap(maps[t], header.table[t].bytes);
+                ::close(fd);
+                return false;
+            }
+        }
+        ::close(fd);
+        t = 0;
+        ((sets.adoptTable(maps[t], header.table[t].bytes), t++), ...);
+        flags = header.flags;
+        return true;
+    }
+
+    /**
+     * @brief Writes the occupied buckets of the tables of @p sets to a compact snapshot at @p path, encoding
+     * with up to @p threads threads; 0 means one per hardware thread. No thread may modify the sets meanwhile.
+     * @param flags Stored along, for state outside the tables.
+     * @return Whether the snapshot was written; the reason is printed otherwise.
+     */
+    template<typename... SETS>
+    static bool saveCompact(const char* path, uint64_t flags, size_t threads, SETS const&... sets) {
+        static_assert(sizeof...(SETS) <= MAX_TABLES, "too many tables");
+        Header header = {};
+        header.magic = COMPACT_MAGIC;
+        header.version = VERSION;
+        header.tables = sizeof...(SETS);
+        header.flags = flags;
+        threads = threads ? threads : std::max(1U, std::thread::hardware_concurrency());
+
+        std::string temporary = std::string(path) + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            printf("Could not create snapshot %s\n", temporary.c_str());
+            return false;
+        }
+        uint64_t offset = sizeof(Header);
+        size_t t = 0;
+        bool ok = true;
+        ((ok = ok && writeCompactTable(fd, header.table[t++], offset, threads, sets)), ...);
+        ok = ok && writeAll(fd, 0, &header, sizeof(header));
+        ok = ok && fsync(fd) == 0;
+        ok = (::close(fd) == 0) && ok;
+        if(!ok || rename(temporary.c_str(), path)) {
+            printf("Could not write snapshot %s\n", path);
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Loads the compact snapshot at @p path into fresh tables of @p sets, instead of init(), decoding
+     * with up to @p threads threads; 0 means one per hardware thread. The tables are mapped according to the
+     * page, NUMA and prefault policies of the sets. The sets need to be of the types the snapshot was saved
+     * from, in the same order.
+     * @param flags Set to the flags the snapshot was saved with.
+     * @return Whether the snapshot was loaded; the reason is printed otherwise and the sets are untouched.
+     */
+    template<typename... SETS>
+    static bool openCompact(const char* path, uint64_t& flags, size_t threads, SETS&... sets) {
+        int fd = ::open(path, O_RDONLY);
+        if(fd < 0) {
+            printf("Could not open snapshot %s\n", path);
+            return false;
+        }
+        threads = threads ? threads : std::max(1U, std::thread::hardware_concurrency());
+        Header header;
+        off_t size = lseek(fd, 0, SEEK_END);
+        bool ok = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+        ok = ok && header.magic == COMPACT_MAGIC && header.version == VERSION && header.tables == sizeof...(SETS);
+        size_t t = 0;
+        ((ok = ok && header.table[t].hashCheck == sets.getHashCheck() && header.table[t].bytes
+                  && (header.table[t].bytes & (header.table[t].bytes - 1)) == 0, t++), ...);
+
+        void* maps[sizeof...(SETS)] = {};
+        t = 0;
+        ((ok = ok && (maps[t] = readCompactTable(fd, size, header.table[t], threads, sets)), t++), ...);
+        ::close(fd);
+        if(!ok) {
+            printf("Not a compatible snapshot: %s\n", path);
+            for(t = 0; t < sizeof...(SETS); ++t) {
+                if(maps[t]) munmap(maps[t], header.table[t].bytes);
+            }
+            return false;
+        }
+        t = 0;
+        ((sets.adoptTable(maps[t], header.table[t].bytes, sets.getPageBacking()), t++), ...);
+        flags = header.flags;
+        return true;
+    }
+
+    static uint64_t align(uint64_t bytes) {
+        return (bytes + ALIGNMENT - 1) & ~(uint64_t)(ALIGNMENT - 1);
+    }
+
+private:
+
+    static bool fits(Table const& table, off_t size) {
+        return table.bytes && (table.bytes & (table.bytes - 1)) == 0 && table.offset % ALIGNMENT == 0
+            && table.offset + table.bytes <= (uint64_t)size;
+    }
+
+    /**
+     * @brief Writes the chunks of @p table that are not entirely zero, leaving holes for the others.
+     */
+    static bool writeTable(int fd, Table const& table, const void* map) {
+        for(uint64_t chunk = 0; chunk < table.bytes; chunk += ALIGNMENT) {
+            size_t bytes = std::min((uint64_t)ALIGNMENT, table.bytes - chunk);
+            const uint64_t* words = (const uint64_t*)((const char*)map + chunk);
+            size_t w = 0;
+            while(w < bytes / sizeof(uint64_t) && !__atomic_load_n(&words[w], __ATOMIC_RELAXED)) ++w;
+            if(w < bytes / sizeof(uint64_t) && !writeAll(fd, table.offset + chunk, words, bytes)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static size_t blocks(Table const& table, size_t bucketWords) {
+        size_t buckets = table.bytes / sizeof(uint64_t) / bucketWords;
+        return (buckets + BLOCK_BUCKETS - 1) / BLOCK_BUCKETS;
+    }
+
+    /**
+     * @brief Writes the block index and the blocks of the table of @p set at @p offset, which is advanced
+     * past them, and describes it in @p table.
+     */
+    template<typename SET>
+    static bool writeCompactTable(int fd, Table& table, uint64_t& offset, size_t threads, SET const& set) {
+        constexpr size_t W = SET::BUCKET_WORDS;
+        table = {set.getTableBytes(), offset, set.getHashCheck()};
+        const uint64_t* map = (const uint64_t*)set.getTable();
+        size_t buckets = table.bytes / sizeof(uint64_t) / W;
+        size_t n = blocks(table, W);
+
+        // Every thread encodes consecutive blocks into its own buffer
+        std::vector<std::vector<uint8_t>> parts(std::min(threads, n));
+        std::vector<uint64_t> index(n + 1);
+        SET::parallelFor(n, parts.size(), [&](size_t begin, size_t end, size_t part) {
+            std::vector<uint8_t>& out = parts[part];
+            for(size_t block = begin; block < end; ++block) {
+                size_t next = block * BLOCK_BUCKETS;
+                size_t last = std::min(buckets, next + BLOCK_BUCKETS);
+                for(size_t b = next; b < last; ++b) {
+                    uint64_t words[W];
+                    bool occupied = false;
+                    for(size_t w = 0; w < W; ++w) {
+                        words[w] = __atomic_load_n(&map[b * W + w], __ATOMIC_RELAXED);
+                        occupied |= words[w] != 0;
+                    }
+                    if(!occupied) continue;
+                    putVarint(out, b - next);
+                    for(size_t w = 0; w < W; ++w) {
+                        putVarint(out, (uint32_t)words[w]);
+                        putVarint(out, words[w] >> 32);
+                    }
+                    next = b + 1;
+                }
+                index[block + 1] = out.size();
+            }
+        });
+
+        // Turn the sizes within the parts into file offsets
+        uint64_t position = offset + (n + 1) * sizeof(uint64_t);
+        index[0] = position;
+        size_t block = 0;
+        for(size_t part = 0; part < parts.size(); ++part) {
+            size_t end = n * (part + 1) / parts.size();
+            for(; block < end; ++block) {
+                index[block + 1] += position;
+            }
+            position += parts[part].size();
+        }
+        if(!writeAll(fd, offset, index.data(), index.size() * sizeof(uint64_t))) return false;
+        for(auto& part: parts) {
+            if(!writeAll(fd, index[0], part.data(), part.size())) return false;
+            index[0] += part.size();
+        }
+        offset = position;
+        return true;
+    }
+
+    /**
+     * @brief Maps a table for @p set and decodes the blocks described by @p table into it.
+     * @return The table, or nullptr if the blocks are malformed.
+     */
+    template<typename SET>
+    static void* readCompactTable(int fd, off_t size, Table const& table, size_t threads, SET& set) {
+        constexpr size_t W = SET::BUCKET_WORDS;
+        size_t buckets = table.bytes / sizeof(uint64_t) / W;
+        size_t n = blocks(table, W);
+        std::vector<uint64_t> index(n + 1);
+        if(table.offset + index.size() * sizeof(uint64_t) > (uint64_t)size) return nullptr;
+        if(pread(fd, index.data(), index.size() * sizeof(uint64_t), table.offset) != (ssize_t)(index.size() * sizeof(uint64_t))) return nullptr;
+        for(size_t block = 0; block < n; ++block) {
+            if(index[block] > index[block + 1]) return nullptr;
+        }
+        if(index[n] > (uint64_t)size) return nullptr;
+
+        uint64_t* map = (uint64_t*)set.mapTable(table.bytes);
+        std::atomic<bool> ok(true);
+        SET::parallelFor(n, threads, [&](size_t begin, size_t end, size_t) {
+            std::vector<uint8_t> in(index[end] - index[begin]);
+            if(pread(fd, in.data(), in.size(), index[begin]) != (ssize_t)in.size()) {
+                ok = false;
+                return;
+            }
+            for(size_t block = begin; block < end; ++block) {
+                const uint8_t* p = in.data() + (index[block] - index[begin]);
+                const uint8_t* blockEnd = in.data() + (index[block + 1] - index[begin]);
+                size_t next = block * BLOCK_BUCKETS;
+                size_t last = std::min(buckets, next + BLOCK_BUCKETS);
+                while(p < blockEnd) {
+                    uint64_t gap, lo, hi;
+                    if(!getVarint(p, blockEnd, gap) || gap >= last - next) {
+                        ok = false;
+                        return;
+                    }
+                    size_t b = next + gap;
+                    for(size_t w = 0; w < W; ++w) {
+                        if(!getVarint(p, blockEnd, lo) || !getVarint(p, blockEnd, hi)) {
+                            ok = false;
+                            return;
+                        }
+                        __atomic_store_n(&map[b * W + w], (hi << 32) | (uint32_t)lo, __ATOMIC_RELAXED);
+                    }
+                    next = b + 1;
+                }
+            }
+        });
+        if(!ok) {
+            munmap(map, table.bytes);
+            return nullptr;
+        }
+        return map;
+    }
+
+    static void putVarint(std::vector<uint8_t>& out, uint64_t v) {
+        while(v >= 0x80) {
+            out.push_back((uint8_t)v | 0x80);
+            v >>= 7;
+        }
+        out.push_back((uint8_t)v);
+    }
+
+    static bool getVarint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+        v = 0;
+        for(size_t shift = 0; p < end && shift < 64; shift += 7) {
+            uint8_t byte = *p++;
+            v |= (uint64_t)(byte & 0x7F) << shift;
+            if(!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
+    static bool writeAll(int fd, uint64_t offset, const void* data, size_t bytes) {
+        while(bytes) {
+            ssize_t written = pwrite(fd, data, bytes, offset);
+            if(written <= 0) return false;
+            data = (const char*)data + written;
+            offset += written;
+            bytes -= written;
+        }
+        return true;
+    }
+};
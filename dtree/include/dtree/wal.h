@@ -0,0 +1,215 @@
+/*
+ * Dtree - a concurrent compression tree for variable-length vectors
+ * Copyright © 2018-2021 Freark van der Berg
+ *
+ * This file is part of Dtree.
+ *
+ * Dtree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Dtree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Dtree.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * @brief Append-only log of the buckets newly inserted into hash sets, to recover the inserts made after the
+ * last Snapshot when a run crashes.
+ *
+ * Every thread that inserts appends records to a buffer of its own, without synchronization, and writes the
+ * buffer to a file of its own, <path>.<n>, once it holds BATCH_RECORDS records. A record holds the table it
+ * belongs to, the ID of the bucket and its words, so replay() puts every bucket back at the same ID.
+ *
+ * Records still buffered are lost on a crash, up to BATCH_RECORDS per thread. Because threads flush
+ * independently, a recovered root may refer to a node that another thread had not flushed yet; call flush()
+ * where the log needs to be complete, e.g., between BFS levels. Only hash sets whose IDs never change can be
+ * logged, i.e., not those with a resizing Rehasher.
+ */
+class WriteAheadLog {
+public:
+    static constexpr size_t BATCH_RECORDS = 1ULL << 14;
+
+    struct Record {
+        uint32_t table;
+        uint32_t check;
+        uint64_t id;
+        uint64_t key;
+        uint64_t key2;
+    };
+
+    WriteAheadLog(): _buffers(nullptr), _files(0), _instance(nextInstance().fetch_add(1, std::memory_order_relaxed)) {
+    }
+
+    WriteAheadLog(WriteAheadLog const&) = delete;
+    WriteAheadLog& operator=(WriteAheadLog const&) = delete;
+
+    ~WriteAheadLog() {
+        flush(false);
+        Buffer* b = _buffers.load(std::memory_order_acquire);
+        while(b) {
+            Buffer* next = b->next;
+            if(b->fd >= 0) ::close(b->fd);
+            delete b;
+            b = next;
+        }
+    }
+
+    /**
+     * @brief Starts logging to files prefixed by @p path, removing the files of an earlier log there. Must be
+     * called before the first append().
+     */
+    void open(const char* path) {
+        _path = path;
+        for(size_t n = 0; unlink(fileName(_path, n).c_str()) == 0; ++n);
+    }
+
+    /**
+     * @brief Appends that bucket @p id of table @p table now holds @p key and @p key2.
+     */
+    __attribute__((always_inline))
+    void append(uint32_t table, uint64_t id, uint64_t key, uint64_t key2) {
+        Buffer* b = buffer();
+        Record& r = b->records[b->count++];
+        r.table = table;
+        r.id = id;
+        r.key = key;
+        r.key2 = key2;
+        r.check = check(r);
+        if(__builtin_expect(b->count == BATCH_RECORDS, 0)) {
+            write(*b);
+        }
+    }
+
+    /**
+     * @brief Writes the records buffered by all threads and, if @p sync, waits until they are on disk. No
+     * thread may append meanwhile.
+     */
+    void flush(bool sync = true) {
+        for(Buffer* b = _buffers.load(std::memory_order_acquire); b; b = b->next) {
+            write(*b);
+            if(sync && b->fd >= 0) fdatasync(b->fd);
+        }
+    }
+
+    /**
+     * @brief Calls @p func(table, id, key, key2) for every record in the log files prefixed by @p path. The
+     * records of a file are read up to the first incomplete or damaged one, which a crash may leave behind.
+     * @return The number of records read.
+     */
+    template<typename FUNC>
+    static size_t replay(const char* path, FUNC&& func) {
+        size_t records = 0;
+        std::vector<Record> batch(BATCH_RECORDS);
+        for(size_t n = 0;; ++n) {
+            int fd = ::open(fileName(path, n).c_str(), O_RDONLY);
+            if(fd < 0) break;
+            bool intact = true;
+            ssize_t bytes;
+            while(intact && (bytes = read(fd, batch.data(), batch.size() * sizeof(Record))) > 0) {
+                size_t count = bytes / sizeof(Record);
+                for(size_t i = 0; i < count && (intact = batch[i].check == check(batch[i])); ++i) {
+                    func(batch[i].table, batch[i].id, batch[i].key, batch[i].key2);
+                    records++;
+                }
+                intact = intact && bytes % sizeof(Record) == 0;
+            }
+            ::close(fd);
+        }
+        return records;
+    }
+
+private:
+
+    struct Buffer {
+        Record records[BATCH_RECORDS];
+        size_t count = 0;
+        int fd = -1;
+        std::thread::id owner;
+        Buffer* next = nullptr;
+    };
+
+    /**
+     * @brief The buffer of the calling thread, which is registered on its first append to this log. Only the
+     * buffer of the last log a thread appended to is cached.
+     */
+    __attribute__((always_inline))
+    Buffer* buffer() {
+        static thread_local size_t cachedInstance = ~0ULL;
+        static thread_local Buffer* cached = nullptr;
+        if(__builtin_expect(cachedInstance != _instance, 0)) {
+            cached = registerBuffer();
+            cachedInstance = _instance;
+        }
+        return cached;
+    }
+
+    Buffer* registerBuffer() {
+        for(Buffer* b = _buffers.load(std::memory_order_acquire); b; b = b->next) {
+            if(b->owner == std::this_thread::get_id()) return b;
+        }
+        Buffer* b = new Buffer();
+        b->owner = std::this_thread::get_id();
+        b->fd = ::open(fileName(_path, _files.fetch_add(1, std::memory_order_relaxed)).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if(b->fd < 0) {
+            printf("Could not create log file for %s\n", _path.c_str());
+            exit(-1);
+        }
+        b->next = _buffers.load(std::memory_order_relaxed);
+        while(!_buffers.compare_exchange_weak(b->next, b, std::memory_order_release, std::memory_order_relaxed));
+        return b;
+    }
+
+    void write(Buffer& b) {
+        const char* data = (const char*)b.records;
+        size_t bytes = b.count * sizeof(Record);
+        while(bytes) {
+            ssize_t written = ::write(b.fd, data, bytes);
+            if(written <= 0) {
+                printf("Could not write log file for %s\n", _path.c_str());
+                exit(-1);
+            }
+            data += written;
+            bytes -= written;
+        }
+        b.count = 0;
+    }
+
+    static uint32_t check(Record const& r) {
+        uint64_t h = (r.id * 0x9E3779B97F4A7C15ULL) ^ r.table;
+        h = (h ^ r.key) * 0xff51afd7ed558ccdULL;
+        h = (h ^ r.key2) * 0xc4ceb9fe1a85ec53ULL;
+        return (h >> 32) ^ 0x57A1;
+    }
+
+    static std::string fileName(std::string const& path, size_t n) {
+        return path + "." + std::to_string(n);
+    }
+
+    static std::atomic<size_t>& nextInstance() {
+        static std::atomic<size_t> instance(0);
+        return instance;
+    }
+
+    std::string _path;
+    std::atomic<Buffer*> _buffers;
+    std::atomic<size_t> _files;
+    const size_t _instance;
+};
@@ -20,7 +20,11 @@
 
 #include <getopt.h>
 
+#include <dtreetest/dtreebench.h>
+#include <dtreetest/dtreebfs.h>
 #include <dtreetest/dtreetest.h>
+#include <dtreetest/hashbench.h>
+#include <dtreetest/hashsettest.h>
 #include <libfrugi/Settings.h>
 
 //#include "wrappers.h"
@@ -38,6 +42,42 @@ void runTest(std::string const& name) {
 //        dtreeTest<dtree<MultiLevelhashSet<HashSet<RehasherExit, Linear> > > > (settings["buckets_scale"].asUnsignedValue()).go();
     } else if(name == "dtree.sr") {
         dtreeTest<dtree<SeparateRootSingleHashSet<HashSet128<RehasherExit, Linear>, HashSet<RehasherExit, Linear> > > > (settings["buckets_scale"].asUnsignedValue()).go();
+    } else if(name == "dtree.seg") {
+        dtreeTest<dtree<SeparateRootSegmentedHashSet<HashSet<RehasherExit, QuadLinear, HashMurmur64> > > > (settings["buckets_scale"].asUnsignedValue()).go();
+    } else if(name == "dtree.dw") {
+        dtreeTest<dtree<SeparateDWordRootSingleHashSet<HashSet128DWCAS<RehasherExit, Linear>, HashSet<RehasherExit, Linear> > > > (settings["buckets_scale"].asUnsignedValue()).go();
+    } else if(name == "dtree.bench") {
+        dtreeBenchConfig config;
+        config.threads = settings["threads"].asUnsignedValue();
+        config.inserts = settings["inserts"].asUnsignedValue();
+        config.length = settings["length"].asUnsignedValue();
+        config.duplicateRatio = settings["duplicateratio"].asDouble();
+        config.collisionRatio = settings["collisionratio"].asDouble();
+        config.scale = settings["buckets_scale"].asUnsignedValue();
+        config.seed = settings["seed"].asUnsignedValue();
+        config.pages = (MMapper::Pages)settings["pages"].asUnsignedValue();
+        config.numa.placement = (MMapper::Numa)settings["numa"].asUnsignedValue();
+        config.numa.node = settings["numanode"].asUnsignedValue();
+        config.prefault = (MMapper::Prefault)settings["prefault"].asUnsignedValue();
+        config.snapshot = settings["snapshot"].asUnsignedValue();
+        config.log = settings["log"].asUnsignedValue();
+        dtreeBench<dtree<SeparateRootSingleHashSet<HashSet<RehasherExit, QuadLinear, HashMurmur64>, HashSet<RehasherExit, QuadLinear, HashMurmur64> > > >(config).go();
+    } else if(name == "dtree.bfs") {
+        dtreeBfsConfig config;
+        config.threads = settings["threads"].asUnsignedValue();
+        config.states = settings["inserts"].asUnsignedValue();
+        config.length = settings["length"].asUnsignedValue();
+        config.branching = settings["branching"].asUnsignedValue();
+        config.changes = settings["changes"].asUnsignedValue();
+        config.locality = settings["locality"].asDouble();
+        config.growth = settings["growth"].asDouble();
+        config.scale = settings["buckets_scale"].asUnsignedValue();
+        config.seed = settings["seed"].asUnsignedValue();
+        dtreeBfs<dtree<SeparateRootSingleHashSet<HashSet<RehasherExit, QuadLinear, HashMurmur64>, HashSet<RehasherExit, QuadLinear, HashMurmur64> > > >(config).go();
+    } else if(name == "hash.probes") {
+        hashProbeBench(settings["buckets_scale"].asUnsignedValue(), settings["inserts"].asUnsignedValue()).go();
+    } else if(name == "hash.test") {
+        hashSetTest(settings["buckets_scale"].asUnsignedValue()).go();
     } else {
         printf("No such compression data structure: %s\n", name.c_str());
     }
@@ -51,6 +91,18 @@ int main(int argc, char** argv) {
     settings["duplicateratio"] = 0.0;
     settings["collisionratio"] = 1.0;
     settings["inserts"] = 100000;
+    settings["length"] = 64;
+    settings["seed"] = 0;
+    settings["pages"] = 0;
+    settings["numa"] = 0;
+    settings["numanode"] = 0;
+    settings["prefault"] = 0;
+    settings["snapshot"] = 0;
+    settings["log"] = 0;
+    settings["branching"] = 4;
+    settings["changes"] = 3;
+    settings["locality"] = 0.8;
+    settings["growth"] = 0.02;
     settings["buckets_scale"] = 28;
     settings["page_size_scale"] = 28;
     settings["stats"] = 0;
@@ -0,0 +1,306 @@
+/*
+ * Dtree - a concurrent compression tree for variable-length vectors
+ * Copyright © 2018-2021 Freark van der Berg
+ *
+ * This file is part of Dtree.
+ *
+ * Dtree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Dtree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Dtree.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dtree/dtree.h>
+
+/**
+ * Parameters of a dtreeBench run.
+ */
+struct dtreeBenchConfig {
+    size_t threads = 1;             // Runs are done for 1, 2, 4, ... up to this many threads
+    size_t inserts = 100000;        // Number of vectors inserted per run, over all threads
+    size_t length = 64;             // Length of the vectors in 32-bit units
+    double duplicateRatio = 0.0;    // Fraction of the inserts that repeat an earlier vector
+    double collisionRatio = 1.0;    // Fraction of the words taken from a vector shared by all vectors
+    size_t scale = 24;              // Scale of the hash sets of the tree
+    uint64_t seed = 0;              // Seed of the generated vectors
+    MMapper::Pages pages = MMapper::Pages::SMALL; // Largest pages the hash sets may be backed with
+    MMapper::NumaPolicy numa;       // Placement of the pages of the hash sets over NUMA nodes
+    MMapper::Prefault prefault = MMapper::Prefault::LAZY; // Backing of the hash sets before the inserts
+    bool snapshot = false;          // Saves and reopens the tree after each run, see checkSnapshot()
+    bool log = false;               // Logs the inserted nodes to a WriteAheadLog in the working directory
+};
+
+/**
+ * Multi-threaded throughput benchmark. For every thread count, a fresh tree is filled by all threads in
+ * parallel, after which the threads find, get and delta the vectors they inserted. Each phase reports the
+ * number of operations per second. The time init() took, which includes prefaulting the tables, is
+ * reported separately.
+ *
+ * The remote column estimates the fraction of accesses to the tables that go to another NUMA node than
+ * the one of the accessing thread. Hash set accesses are spread uniformly over the tables, so this is the
+ * fraction of sampled table pages that are not on the node each worker ran on at the end of the inserts.
+ *
+ * Vector @c g is generated from its number alone, so runs are reproducible regardless of the scheduling of
+ * threads. Word 0 holds @c g, which makes every vector unique; the other words are taken from a shared
+ * base vector with probability collisionRatio and are random otherwise, so subtrees are shared more as the
+ * ratio approaches 1. A duplicate is a copy of an earlier vector.
+ */
+template<typename TREE>
+class dtreeBench {
+public:
+    using Index = typename TREE::Index;
+
+    dtreeBench(dtreeBenchConfig const& config): _config(config), _base(config.length) {
+        uint64_t r = _config.seed;
+        for(auto& w: _base) {
+            r = mix(r + 1);
+            w = r;
+        }
+    }
+
+    void go() {
+        printf("\n:: Throughput, %zu vectors of length %zu, duplicate ratio %.2f, collision ratio %.2f, scale %zu\n"
+              , _config.inserts, _config.length, _config.duplicateRatio, _config.collisionRatio, _config.scale
+              );
+        printf("%8s %14s %14s %14s %14s %8s %8s %8s\n", "threads", "inserts/s", "finds/s", "gets/s", "deltas/s", "errors", "remote", "init ms");
+        for(size_t threads = 1; threads <= _config.threads; threads <<= 1) {
+            run(threads);
+            if(threads < _config.threads && threads * 2 > _config.threads) {
+                run(_config.threads);
+            }
+        }
+    }
+
+    void run(size_t threads) {
+        TREE* tree = new TREE();
+        tree->setScale(_config.scale);
+        tree->setPagePolicy(_config.pages);
+        tree->setNumaPolicy(_config.numa);
+        tree->setPrefault(_config.prefault, threads);
+        auto initStart = std::chrono::steady_clock::now();
+        tree->init();
+        double init = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - initStart).count();
+        if(!_reportedPages) {
+            printf("%8s root: %s, data: %s\n", "pages", MMapper::name(tree->getPageBacking(0)), MMapper::name(tree->getPageBacking(1)));
+            _reportedPages = true;
+        }
+
+        std::vector<Index> indices(_config.inserts);
+        std::atomic<size_t> errors(0);
+        WriteAheadLog log;
+        if(_config.log) {
+            log.open("dtreebench.log");
+            tree->setWriteAheadLog(&log);
+        }
+
+        double inserts = phase(threads, [&](size_t g, uint32_t* buffer) {
+            generate(g, buffer);
+            indices[g] = tree->insert(buffer, _config.length, true).getState();
+        });
+        double remote = remoteRatio(*tree);
+        double finds = phase(threads, [&](size_t g, uint32_t* buffer) {
+            generate(g, buffer);
+            if(tree->find(buffer, _config.length, true) == Index::NotFound()) {
+                errors.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+        double gets = phase(threads, [&](size_t g, uint32_t* buffer) {
+            tree->get(indices[g], buffer, true);
+            if(buffer[0] != original(g)) {
+                errors.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+        double deltas = phase(threads, [&](size_t g, uint32_t* buffer) {
+            uint64_t r = mix(g ^ _config.seed ^ 0xDE17AULL);
+            uint32_t value = r >> 32;
+            tree->delta(indices[g], 1 + r % (_config.length - 1), &value, 1, true);
+        });
+
+        printf("%8zu %14.0f %14.0f %14.0f %14.0f %8zu %7.1f%% %8.1f\n", threads, inserts, finds, gets, deltas, errors.load(), 100.0 * remote, init);
+        if(_config.snapshot) {
+            checkSnapshot(*tree, indices, false);
+            checkSnapshot(*tree, indices, true);
+        }
+        if(_config.log) {
+            log.flush();
+            checkLog(indices);
+            log.open("dtreebench.log");
+        }
+        delete tree;
+    }
+
+    /**
+     * Replays the log of the last run into a fresh tree and gets all @p indices from that tree, which should
+     * give the vectors that were inserted.
+     */
+    void checkLog(std::vector<Index> const& indices) {
+        TREE* replayed = new TREE();
+        replayed->setScale(_config.scale);
+        replayed->init();
+        auto start = std::chrono::steady_clock::now();
+        size_t records = replayed->replay("dtreebench.log");
+        double replay = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::vector<uint32_t> buffer(_config.length + 1);
+        std::vector<uint32_t> expected(_config.length + 1);
+        size_t errors = 0;
+        for(size_t g = 0; g < indices.size(); ++g) {
+            replayed->get(indices[g], buffer.data(), true);
+            generate(g, expected.data());
+            errors += !std::equal(expected.begin(), expected.begin() + _config.length, buffer.begin());
+        }
+        printf("%8s %zu records, replay %.1f ms, %zu errors\n", "log", records, replay, errors);
+        delete replayed;
+    }
+
+    /**
+     * Saves @p tree to a snapshot in the working directory, compact or not, opens it in a fresh tree and gets
+     * all @p indices from that tree, which should give the vectors that were inserted.
+     */
+    void checkSnapshot(TREE& tree, std::vector<Index> const& indices, bool compact) {
+        const char* path = "dtreebench.snapshot";
+        auto start = std::chrono::steady_clock::now();
+        if(!(compact ? tree.saveCompact(path) : tree.save(path))) return;
+        double save = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        struct stat st = {};
+        stat(path, &st);
+
+        TREE* opened = new TREE();
+        opened->setPagePolicy(_config.pages);
+        opened->setNumaPolicy(_config.numa);
+        start = std::chrono::steady_clock::now();
+        if(compact ? opened->openCompact(path) : opened->open(path)) {
+            double open = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::vector<uint32_t> buffer(_config.length + 1);
+            std::vector<uint32_t> expected(_config.length + 1);
+            size_t errors = 0;
+            start = std::chrono::steady_clock::now();
+            for(size_t g = 0; g < indices.size(); ++g) {
+                opened->get(indices[g], buffer.data(), true);
+                generate(g, expected.data());
+                errors += !std::equal(expected.begin(), expected.begin() + _config.length, buffer.begin());
+            }
+            double gets = indices.size() / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            printf("%8s %s: %.1f MiB on disk, save %.1f ms, open %.1f ms, %.0f gets/s, %zu errors\n"
+                  , "snapshot", compact ? "compact" : "mapped", st.st_blocks * 512.0 / (1 << 20), save, open, gets, errors
+                  );
+        }
+        delete opened;
+        unlink(path);
+    }
+
+    /**
+     * Runs @p op for every vector number, distributed over @p threads threads.
+     * @return The number of operations per second.
+     */
+    template<typename OP>
+    double phase(size_t threads, OP&& op) {
+        std::atomic<size_t> ready(0);
+        std::atomic<bool> go(false);
+        std::vector<std::thread> workers;
+        _nodes.assign(threads, 0);
+        for(size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                std::vector<uint32_t> buffer(_config.length + 1);
+                ready.fetch_add(1);
+                while(!go.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                for(size_t g = t; g < _config.inserts; g += threads) {
+                    op(g, buffer.data());
+                }
+                _nodes[t] = MMapper::currentNode();
+            });
+        }
+        while(ready.load() < threads) {
+            std::this_thread::yield();
+        }
+        auto start = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        for(auto& w: workers) {
+            w.join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return _config.inserts / seconds;
+    }
+
+    /**
+     * The fraction of the pages of the tables of @p tree that are not on the node of the workers of the last
+     * phase, averaged over the workers.
+     */
+    double remoteRatio(TREE& tree) const {
+        std::vector<size_t> pages;
+        tree.getNodeStats(pages, 0);
+        tree.getNodeStats(pages, 1);
+        size_t total = 0;
+        for(size_t p: pages) {
+            total += p;
+        }
+        if(!total || _nodes.empty()) return 0.0;
+        double remote = 0.0;
+        for(int node: _nodes) {
+            remote += 1.0 - ((size_t)node < pages.size() ? pages[node] : 0) / (double)total;
+        }
+        return remote / _nodes.size();
+    }
+
+    /**
+     * The number of the vector that vector @p g is a copy of, or @p g itself if it is not a duplicate.
+     */
+    size_t original(size_t g) const {
+        while(g > 0) {
+            uint64_t r = mix(g ^ _config.seed);
+            if(unit(r) >= _config.duplicateRatio) break;
+            g = mix(r) % g;
+        }
+        return g;
+    }
+
+    void generate(size_t g, uint32_t* buffer) const {
+        g = original(g);
+        uint64_t r = mix(g ^ _config.seed ^ 0xC0111DEULL);
+        buffer[0] = g;
+        for(size_t i = 1; i < _config.length; ++i) {
+            r = mix(r + i);
+            buffer[i] = unit(r) < _config.collisionRatio ? _base[i] : (uint32_t)(r >> 32);
+        }
+    }
+
+    static uint64_t mix(uint64_t h) {
+        h += 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static double unit(uint64_t r) {
+        return (r >> 11) * 0x1.0p-53;
+    }
+
+private:
+    dtreeBenchConfig _config;
+    std::vector<uint32_t> _base;
+    bool _reportedPages = false;
+    std::vector<int> _nodes;
+};
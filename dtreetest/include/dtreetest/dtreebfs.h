@@ -0,0 +1,333 @@
+/*
+ * Dtree - a concurrent compression tree for variable-length vectors
+ * Copyright © 2018-2021 Freark van der Berg
+ *
+ * This file is part of Dtree.
+ *
+ * Dtree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Dtree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Dtree.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <dtree/dtree.h>
+#include <dtreetest/dtreebench.h>
+
+/**
+ * Histogram of latencies with power-of-two buckets: bucket @c b counts the latencies in [2^b, 2^(b+1)) ns,
+ * bucket 0 also counts latencies below 1 ns.
+ */
+struct dtreeLatencyHistogram {
+    static constexpr size_t BUCKETS = 40;
+
+    void record(uint64_t ns) {
+        size_t b = ns ? 63 - __builtin_clzll(ns) : 0;
+        _buckets[std::min(b, BUCKETS - 1)]++;
+        _count++;
+        _total += ns;
+    }
+
+    void merge(dtreeLatencyHistogram const& other) {
+        for(size_t b = 0; b < BUCKETS; ++b) {
+            _buckets[b] += other._buckets[b];
+        }
+        _count += other._count;
+        _total += other._total;
+    }
+
+    /**
+     * @return The upper bound in ns of the bucket that holds percentile @p p, which is in [0, 1].
+     */
+    uint64_t percentile(double p) const {
+        size_t target = p * _count;
+        size_t seen = 0;
+        for(size_t b = 0; b < BUCKETS; ++b) {
+            seen += _buckets[b];
+            if(seen > target) return 2ULL << b;
+        }
+        return 2ULL << (BUCKETS - 1);
+    }
+
+    void print(const char* name) const {
+        printf("%-18s %10zu %10.0f %10zu %10zu %10zu %10zu\n", name, _count, _count ? (double)_total / _count : 0.0
+              , percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999)
+              );
+        if(!_count) return;
+        size_t first = 0;
+        size_t last = BUCKETS - 1;
+        while(!_buckets[first]) first++;
+        while(!_buckets[last]) last--;
+        for(size_t b = first; b <= last; ++b) {
+            printf("    < %10zu ns %10zu %6.2f%%\n", (size_t)(2ULL << b), _buckets[b], 100.0 * _buckets[b] / _count);
+        }
+    }
+
+    size_t _buckets[BUCKETS] = {};
+    size_t _count = 0;
+    uint64_t _total = 0;
+};
+
+/**
+ * Parameters of a dtreeBfs run.
+ */
+struct dtreeBfsConfig {
+    size_t threads = 1;             // Number of threads exploring a BFS level in parallel
+    size_t states = 100000;         // Number of successors generated, over all threads
+    size_t length = 64;             // Length of the initial state in 32-bit units
+    size_t maxLength = 0;           // States do not grow beyond this length; 0 means twice the initial length
+    size_t branching = 4;           // Number of successors per state
+    size_t changes = 3;             // Number of words a successor changes
+    double locality = 0.8;          // Probability that a changed word lies close to the previous changed word
+    double growth = 0.02;           // Fraction of the successors that grow the state
+    size_t scale = 24;              // Scale of the hash sets of the tree
+    uint64_t seed = 0;              // Seed of the generated changes
+};
+
+/**
+ * Workload that resembles the state space exploration of a model checker. Starting from a single initial
+ * state, every state of a BFS level is expanded into @c branching successors. A successor is derived from
+ * its parent Index only, never by a full insert:
+ *  - a contiguous delta() of @c changes words,
+ *  - a deltaSparse() of @c changes scattered words,
+ *  - a getPartial() of @c changes word pairs through a MultiProjection, followed by a delta() through the
+ *    same projection, like a transition that reads and then writes a few variables,
+ *  - with probability @c growth, an extendAt() or a deltaMayExtend() that appends a word, like a
+ *    transition that allocates.
+ * The first changed word is chosen uniformly, every next one lies within four words of the previous with
+ * probability @c locality. Written values are taken from a small domain, so states are revisited as in a
+ * real state space; only new states are expanded in the next level.
+ *
+ * The latency of every operation is recorded per operation type, including the overhead of reading the
+ * clock, and reported as a histogram at the end of the run.
+ */
+template<typename TREE>
+class dtreeBfs {
+public:
+    using Index = typename TREE::Index;
+    using SparseOffset = typename TREE::SparseOffset;
+    using Projection = typename TREE::Projection;
+    using MultiProjection = typename TREE::MultiProjection;
+
+    enum Op {
+        DELTA,
+        DELTA_SPARSE,
+        GET_PARTIAL,
+        DELTA_PROJECTION,
+        EXTEND_AT,
+        DELTA_MAY_EXTEND,
+        OPS
+    };
+
+    struct Worker {
+        dtreeLatencyHistogram histograms[OPS];
+        std::vector<Index> next;
+        uint64_t r = 0;
+    };
+
+    dtreeBfs(dtreeBfsConfig const& config): _config(config) {
+        if(!_config.maxLength) {
+            _config.maxLength = 2 * _config.length;
+        }
+    }
+
+    void go() {
+        printf("\n:: BFS exploration, %zu successors, length %zu (max %zu), branching %zu, %zu changes, locality %.2f, growth %.2f, scale %zu\n"
+              , _config.states, _config.length, _config.maxLength, _config.branching, _config.changes, _config.locality
+              , _config.growth, _config.scale
+              );
+        run(_config.threads);
+    }
+
+    void run(size_t threads) {
+        TREE* tree = new TREE();
+        tree->setScale(_config.scale);
+        tree->init();
+
+        std::vector<uint32_t> initial(_config.length);
+        uint64_t r = _config.seed;
+        for(auto& w: initial) {
+            r = dtreeBench<TREE>::mix(r + 1);
+            w = r & 0xFF;
+        }
+        std::vector<Index> frontier{tree->insert(initial.data(), _config.length, true).getState()};
+
+        std::vector<Worker> workers(threads);
+        for(size_t t = 0; t < threads; ++t) {
+            workers[t].r = dtreeBench<TREE>::mix(_config.seed ^ (t << 32));
+        }
+
+        size_t successors = 0;
+        size_t levels = 0;
+        size_t states = 1;
+        auto start = std::chrono::steady_clock::now();
+        while(!frontier.empty() && successors < _config.states) {
+            size_t parents = std::min(frontier.size(), (_config.states - successors + _config.branching - 1) / _config.branching);
+            std::atomic<size_t> cursor(0);
+            std::vector<std::thread> running;
+            for(size_t t = 0; t < threads; ++t) {
+                running.emplace_back([&, t]() {
+                    expand(*tree, frontier, parents, cursor, workers[t]);
+                });
+            }
+            for(auto& t: running) {
+                t.join();
+            }
+            frontier.clear();
+            for(auto& w: workers) {
+                frontier.insert(frontier.end(), w.next.begin(), w.next.end());
+                w.next.clear();
+            }
+            successors += parents * _config.branching;
+            states += frontier.size();
+            levels++;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("%zu levels, %zu successors, %zu states, %.0f successors/s with %zu threads\n"
+              , levels, successors, states, successors / seconds, threads
+              );
+        printf("%-18s %10s %10s %10s %10s %10s %10s\n", "latency (ns)", "ops", "mean", "p50", "p90", "p99", "p99.9");
+        static const char* names[OPS] = {"delta", "deltaSparse", "getPartial", "delta projection", "extendAt", "deltaMayExtend"};
+        for(size_t op = 0; op < OPS; ++op) {
+            dtreeLatencyHistogram h;
+            for(auto& w: workers) {
+                h.merge(w.histograms[op]);
+            }
+            h.print(names[op]);
+        }
+        delete tree;
+    }
+
+    /**
+     * Expands parents from @p frontier until @p parents parents are taken, adding the new successors to
+     * the next frontier of @p w.
+     */
+    void expand(TREE& tree, std::vector<Index> const& frontier, size_t parents, std::atomic<size_t>& cursor, Worker& w) {
+        size_t changes = std::max(_config.changes, (size_t)1);
+        std::vector<uint32_t> positions(changes);
+        std::vector<uint32_t> data(2 * changes);
+        std::vector<uint32_t> partial(2 * changes);
+        std::vector<SparseOffset> offsets(changes);
+        std::vector<uint32_t> projectionBuffer(sizeof(MultiProjection) / sizeof(uint32_t) + 2 * changes);
+        MultiProjection& projection = *(MultiProjection*)projectionBuffer.data();
+
+        for(size_t p; (p = cursor.fetch_add(1, std::memory_order_relaxed)) < parents;) {
+            Index parent = frontier[p];
+            uint32_t length = parent.getLength();
+            for(size_t b = 0; b < _config.branching; ++b) {
+                typename TREE::IndexInserted result;
+                size_t n = choose(w.r, length, changes, positions.data());
+                for(size_t i = 0; i < 2 * n; ++i) {
+                    w.r = dtreeBench<TREE>::mix(w.r);
+                    data[i] = w.r & 0xFF;
+                }
+
+                w.r = dtreeBench<TREE>::mix(w.r);
+                bool grow = length < _config.maxLength && dtreeBench<TREE>::unit(w.r) < _config.growth;
+                Op op = grow ? ((w.r >> 32) & 1 ? EXTEND_AT : DELTA_MAY_EXTEND) : (Op)((w.r >> 32) % 3);
+
+                auto opStart = std::chrono::steady_clock::now();
+                switch(op) {
+                    case DELTA: {
+                        uint32_t offset = std::min(positions[0], length - (uint32_t)std::min((size_t)length, changes));
+                        result = tree.delta(parent, offset, data.data(), std::min((size_t)length, changes), true);
+                        break;
+                    }
+                    case DELTA_SPARSE: {
+                        // Adjacent positions form a single offset
+                        uint32_t k = 0;
+                        for(size_t i = 0; i < n; ++i) {
+                            if(k && offsets[k-1].getOffset() + offsets[k-1].getLength() == positions[i]) {
+                                offsets[k-1]._data++;
+                            } else {
+                                offsets[k++] = SparseOffset(positions[i], 1);
+                            }
+                        }
+                        result = tree.deltaSparse(parent, data.data(), k, Projection(offsets.data()), true);
+                        break;
+                    }
+                    case GET_PARTIAL: {
+                        projection.projections = 0;
+                        projection.maxProjections = n;
+                        projection.maxDepth = 1;
+                        uint32_t last = ~0U;
+                        for(size_t i = 0; i < n; ++i) {
+                            uint32_t pair = std::min(positions[i] & ~1U, (length - 2) & ~1U);
+                            if(pair != last) {
+                                projection.addProjection((uint32_t)MultiOffset::Options::READ_WRITE, 2, {pair});
+                                last = pair;
+                            }
+                        }
+                        tree.getPartial(parent, projection, true, partial.data());
+                        w.histograms[GET_PARTIAL].record(elapsed(opStart));
+                        op = DELTA_PROJECTION;
+                        opStart = std::chrono::steady_clock::now();
+                        result = tree.delta(parent, projection, true, data.data());
+                        break;
+                    }
+                    case EXTEND_AT:
+                        result = tree.extendAt(parent, 0, 1, data.data(), true);
+                        break;
+                    case DELTA_MAY_EXTEND:
+                        result = tree.deltaMayExtend(parent, length - 1, data.data(), 2, true);
+                        break;
+                    default:
+                        break;
+                }
+                w.histograms[op].record(elapsed(opStart));
+
+                if(result.isInserted()) {
+                    w.next.push_back(result.getState());
+                }
+            }
+        }
+    }
+
+    /**
+     * Chooses up to @p changes distinct positions within a vector of length @p length and writes them to
+     * @p positions in ascending order.
+     * @return The number of positions chosen.
+     */
+    size_t choose(uint64_t& r, uint32_t length, size_t changes, uint32_t* positions) {
+        r = dtreeBench<TREE>::mix(r);
+        uint32_t position = (r >> 32) % length;
+        positions[0] = position;
+        for(size_t i = 1; i < changes; ++i) {
+            r = dtreeBench<TREE>::mix(r);
+            if(dtreeBench<TREE>::unit(r) < _config.locality) {
+                position = (position + 1 + ((r >> 8) & 0x3)) % length;
+            } else {
+                position = (r >> 32) % length;
+            }
+            positions[i] = position;
+        }
+        std::sort(positions, positions + changes);
+        return std::unique(positions, positions + changes) - positions;
+    }
+
+    static uint64_t elapsed(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    using MultiOffset = typename TREE::MultiOffset;
+
+    dtreeBfsConfig _config;
+};
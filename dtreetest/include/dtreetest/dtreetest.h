@@ -22,14 +22,17 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <algorithm>
+#include <vector>
 #include <dtree/dtree.h>
 
 template<typename TREE>
 class dtreeTest {
 public:
 
-    dtreeTest(size_t scale): _tree() {
+    dtreeTest(size_t scale): _tree(), _scale(scale) {
         _tree.setScale(scale);
+        _tree.init();
     }
 
     template<bool (*F)(TREE& tree, const char* vector, size_t offset, const char* deltaData)>
@@ -55,6 +58,50 @@ public:
 
     void go() {
 
+        printf("\n:: Testing insertMany()\n");
+
+        testInsertMany(1, 1);
+        testInsertMany(2, 8);
+        testInsertMany(4, 64);
+        testInsertMany(8, 512);
+        testInsertMany(256, 1024);
+
+        printf("\n:: Testing batched node inserts and gets\n");
+
+        testBatch(1);
+        testBatch(15);
+        testBatch(16);
+        testBatch(17);
+        testBatch(1000);
+
+        printf("\n:: Testing insertBytes(), getBytes() and deltaBytes()\n");
+
+        testBytes(_tree, "0", 0, "z");
+        testBytes(_tree, "012", 1, "zZ");
+        testBytes(_tree, "01234", 3, "zZ");
+        testBytes(_tree, "0123456", 0, "zZzZxXx");
+        testBytes(_tree, "0123456789A", 2, "zZzZxX");
+        testBytes(_tree, "0123456789ABCDEF", 5, "zZz");
+        testBytes(_tree, "0123456789ABCDEFG", 16, "z");
+        testBytes(_tree, "0123456789ABCDEFGHI", 4, "");
+
+        testBytes();
+
+        printf("\n:: Testing insertFragments() and getFragments()\n");
+
+        testFragments(_tree, "0123", 0, 1);
+        testFragments(_tree, "0123456789AB", 1, 2);
+        testFragments(_tree, "0123456789ABCDEF", 1, 3);
+        testFragments(_tree, "0123456789ABCDEFGHIJ", 0, 5);
+        testFragments(_tree, "0123456789ABCDEFGHIJ", 3, 3);
+
+        testFragments();
+
+        printf("\n:: Testing long vectors\n");
+
+        testLong(_tree, 1 << 17, 12345, 100);
+        testLong(_tree, (1 << 17) + 3, (1 << 16) - 7, 50);
+
         printf("\n:: Testing getSparse()\n");
 
         testGetSparse(_tree, "0123456789ABCDEF", 0, 2, 2, 2);
@@ -130,6 +177,341 @@ public:
 //                       |
     }
 
+    /**
+     * Exposes the node functions of the storage of TREE, which dtree uses to deconstruct and construct.
+     */
+    struct StorageTree: public TREE {
+        using TREE::storage_fop;
+        using TREE::storage_get;
+        using TREE::storage_fop_batch;
+        using TREE::storage_get_batch;
+    };
+
+    // Storages with separate roots also pass the length of the vector to the node functions
+    template<typename T>
+    static auto storageInsert(T& tree, uint64_t v, int) -> decltype(tree.storage_fop(v, 0, 0, false)) {
+        return tree.storage_fop(v, 0, 0, false);
+    }
+
+    template<typename T>
+    static uint64_t storageInsert(T& tree, uint64_t v, long) {
+        return tree.storage_fop(v, 0, false);
+    }
+
+    template<typename T>
+    static auto storageGet(T& tree, uint64_t idx, int) -> decltype(tree.storage_get(idx, 0, std::declval<uint64_t&>(), false)) {
+        uint64_t length = 0;
+        return tree.storage_get(idx, 0, length, false);
+    }
+
+    template<typename T>
+    static uint64_t storageGet(T& tree, uint64_t idx, long) {
+        return tree.storage_get(idx, 0, false);
+    }
+
+    /**
+     * Inserts @p n nodes, some of them twice, as one batch into a fresh tree and one by one into another, and
+     * checks that both give the same IDs, also when inserting them again. The IDs are then read back as a
+     * batch and one by one, also in place, as dtree expands a level of IDs into nodes.
+     */
+    bool testBatch(uint32_t n) {
+        std::vector<uint64_t> nodes(n);
+        for(uint32_t i = 0; i < n; ++i) {
+            nodes[i] = (i % 7 == 6 ? i / 2 : i) * 0x9E3779B97F4A7C15ULL + 1;
+        }
+
+        StorageTree* batched = new StorageTree();
+        batched->setScale(_scale);
+        batched->init();
+        StorageTree* single = new StorageTree();
+        single->setScale(_scale);
+        single->init();
+
+        std::vector<uint32_t> idsBatched(n);
+        std::vector<uint32_t> idsSingle(n);
+        std::vector<uint32_t> idsAgain(n);
+        batched->storage_fop_batch(nodes.data(), idsBatched.data(), n);
+        for(uint32_t i = 0; i < n; ++i) {
+            idsSingle[i] = storageInsert(*single, nodes[i], 0);
+            uint64_t again = storageInsert(*batched, nodes[i], 0);
+            idsAgain[i] = (again & 0x8000000000000000ULL) ? 0 : again;
+        }
+
+        // The same nodes again as a batch, in place
+        std::vector<uint64_t> inPlace(nodes);
+        batched->storage_fop_batch(inPlace.data(), (uint32_t*)inPlace.data(), n);
+
+        std::vector<uint64_t> nodesBatched(n);
+        std::vector<uint64_t> nodesSingle(n);
+        batched->storage_get_batch(idsBatched.data(), nodesBatched.data(), n);
+        for(uint32_t i = 0; i < n; ++i) {
+            nodesSingle[i] = storageGet(*batched, idsBatched[i], 0);
+        }
+        std::vector<uint64_t> nodesInPlace(n);
+        std::copy(idsBatched.begin(), idsBatched.end(), (uint32_t*)nodesInPlace.data());
+        batched->storage_get_batch((uint32_t*)nodesInPlace.data(), nodesInPlace.data(), n);
+
+        bool wrong = false;
+        for(uint32_t i = 0; i < n; ++i) {
+            auto r = idsBatched[i] != idsSingle[i]
+                  || idsBatched[i] != idsAgain[i]
+                  || idsBatched[i] != ((uint32_t*)inPlace.data())[i]
+                  || nodesBatched[i] != nodes[i]
+                  || nodesSingle[i] != nodes[i]
+                  || nodesInPlace[i] != nodes[i];
+            if(r==0) {
+//                printf("OK!\n");
+            } else {
+                printf("\033[31mWRONG!\033[0m\n");
+                printf("Expected %16zx -> %8x\n", nodes[i], idsSingle[i]);
+                printf("Obtained %16zx -> %8x\n", nodesBatched[i], idsBatched[i]);
+                wrong = true;
+            }
+        }
+        delete batched;
+        delete single;
+        return wrong;
+    }
+
+    /**
+     * Inserts @p n vectors with insertMany() into a fresh tree and one by one with insert() into another.
+     * The vectors are at most @p maxLength long and made of a few distinct words, so the batch holds
+     * duplicates, vectors of length 1 and vectors of different lengths sharing nodes. IDs depend on the
+     * order nodes are inserted in, so the indices of insertMany() are checked against insert() of the same
+     * vectors afterwards into the same tree, which should find them.
+     */
+    bool testInsertMany(size_t maxLength, size_t n) {
+        uint64_t r = n * 0x9E3779B97F4A7C15ULL + maxLength;
+        std::vector<uint32_t> lengths(n);
+        std::vector<uint32_t> data;
+        for(size_t i = 0; i < n; ++i) {
+            r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+            if(i > 0 && (r >> 60) == 0) {
+                // A copy of an earlier vector
+                size_t earlier = (r >> 32) % i;
+                size_t offset = 0;
+                for(size_t j = 0; j < earlier; ++j) offset += lengths[j];
+                lengths[i] = lengths[earlier];
+                for(size_t j = 0; j < lengths[i]; ++j) data.push_back(data[offset + j]);
+                continue;
+            }
+            lengths[i] = 1 + (r >> 33) % maxLength;
+            for(size_t j = 0; j < lengths[i]; ++j) {
+                r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+                data.push_back(0x41414141U + (r >> 62));
+            }
+        }
+
+        TREE* many = new TREE();
+        many->setScale(_scale);
+        many->init();
+        TREE* sequential = new TREE();
+        sequential->setScale(_scale);
+        sequential->init();
+
+        std::vector<typename TREE::IndexInserted> manyResult(n);
+        std::vector<typename TREE::IndexInserted> sequentialResult(n);
+        many->insertMany(data.data(), lengths.data(), n, manyResult.data(), true);
+        size_t offset = 0;
+        for(size_t i = 0; i < n; ++i) {
+            sequentialResult[i] = sequential->insert(&data[offset], lengths[i], true);
+            offset += lengths[i];
+        }
+
+        bool wrong = false;
+        std::vector<uint32_t> bufferResult(maxLength + 1);
+        offset = 0;
+        for(size_t i = 0; i < n; ++i) {
+            uint32_t* vector = &data[offset];
+            offset += lengths[i];
+            bufferResult[lengths[i]] = 0;
+            many->get(manyResult[i].getState(), bufferResult.data(), true);
+            auto again = many->insert(vector, lengths[i], true);
+            bool equalityDiffers = false;
+            for(size_t j = 0; j < i; ++j) {
+                equalityDiffers |= (manyResult[j].getState() == manyResult[i].getState()) != (sequentialResult[j].getState() == sequentialResult[i].getState());
+            }
+            auto r = manyResult[i].isInserted() != sequentialResult[i].isInserted()
+                  || manyResult[i].getState().getLength() != lengths[i]
+                  || again.getState() != manyResult[i].getState()
+                  || again.isInserted()
+                  || equalityDiffers
+                  || memcmp(vector, bufferResult.data(), lengths[i]*sizeof(uint32_t))
+                  || bufferResult[lengths[i]] != 0;
+            if(r==0) {
+//                printf("OK!\n");
+            } else {
+                printf("\033[31mWRONG!\033[0m\n");
+                many->printBuffer("Expected", vector, lengths[i], sequentialResult[i].getState().getData());
+                many->printBuffer("Obtained", bufferResult.data(), lengths[i], manyResult[i].getState().getData());
+                wrong = true;
+            }
+        }
+        delete many;
+        delete sequential;
+        return wrong;
+    }
+
+    void testBytes() {
+        char original[] = "AAAABBBBCCCCDDDDEEEEFFFFGGGGHHHHIIIIJ";
+        char delta[] = "qqqqrrrrs";
+
+        for(size_t length = 1; length < sizeof(original); ++length) {
+            for(size_t deltaLength = 0; deltaLength < sizeof(delta); ++deltaLength) {
+                for(size_t offset = 0; offset + deltaLength <= length; ++offset) {
+                    char save1 = original[length];
+                    char save2 = delta[deltaLength];
+                    original[length] = 0;
+                    delta[deltaLength] = 0;
+                    testBytes(_tree, original, offset, delta);
+                    original[length] = save1;
+                    delta[deltaLength] = save2;
+                }
+            }
+        }
+    }
+
+    static bool testBytes(TREE& tree, const char* vector, size_t offset, const char* deltaData) {
+        return testBytes(tree, (const uint8_t*)vector, strlen(vector), offset, strlen(deltaData), (const uint8_t*)deltaData);
+    }
+
+    static bool testBytes(TREE& tree, const uint8_t* vector, size_t length, size_t offset, uint32_t deltaLength, const uint8_t* deltaData) {
+
+//        printf("  > testBytes(%s, %zu, %s)\n", (char*)vector, offset, (char*)deltaData);
+
+        typename TREE::IndexInserted idx = tree.insertBytes(vector, length, true);
+        typename TREE::IndexInserted idx2 = tree.deltaBytes(idx.getState(), offset, deltaData, deltaLength, true);
+
+        uint8_t bufferCorrect[length + 1];
+        memmove(bufferCorrect, vector, length);
+        memmove(bufferCorrect + offset, deltaData, deltaLength);
+        bufferCorrect[length] = 0;
+
+        uint8_t bufferResult[length + 1];
+        uint8_t bufferOriginal[length + 1];
+        bufferResult[length] = 0;
+        bufferOriginal[length] = 0;
+        tree.getBytes(idx.getState(), bufferOriginal, true);
+        tree.getBytes(idx2.getState(), bufferResult, true);
+
+        // The same delta applied in whole units by delta() should keep the length in bytes
+        size_t units = (length + 3) / 4;
+        uint32_t unitsCorrect[units];
+        unitsCorrect[units - 1] = 0;
+        memcpy(unitsCorrect, bufferCorrect, length);
+        typename TREE::IndexInserted idx3 = tree.delta(idx.getState(), 0, unitsCorrect, units, true);
+        uint8_t bufferUnits[length + 1];
+        bufferUnits[length] = 0xA5;
+        tree.getBytes(idx3.getState(), bufferUnits, true);
+
+        auto r = idx2.getState().getLengthInBytes() != length
+              || idx3.getState().getLengthInBytes() != length
+              || memcmp(vector, bufferOriginal, length)
+              || memcmp(bufferCorrect, bufferResult, length + 1)
+              || memcmp(bufferCorrect, bufferUnits, length)
+              || bufferUnits[length] != 0xA5;
+        if(r==0) {
+//            printf("OK!\n");
+        } else {
+            printf("\033[31mWRONG!\033[0m\n");
+            printf("Expected %.*s\n", (int)length, (char*)bufferCorrect);
+            printf("Obtained %.*s\n", (int)length, (char*)bufferResult);
+        }
+        return false;
+    }
+
+    void testFragments() {
+        char original[] = "AAAABBBBCCCCDDDDEEEEFFFFGGGGHHHHIIIIJJJJKKKKLLLL";
+
+        for(size_t length = 1; length < sizeof(original)/4; ++length) {
+            for(size_t cut1 = 0; cut1 <= length; ++cut1) {
+                for(size_t cut2 = cut1; cut2 <= length; ++cut2) {
+                    testFragments(_tree, (uint32_t*)original, length, cut1, cut2);
+                }
+            }
+        }
+    }
+
+    static bool testFragments(TREE& tree, const char* vector, size_t cut1, size_t cut2) {
+        return testFragments(tree, (uint32_t*)vector, strlen(vector)>>2, cut1, cut2);
+    }
+
+    static bool testFragments(TREE& tree, uint32_t* vector, size_t length, size_t cut1, size_t cut2) {
+
+//        printf("  > testFragments(%s, %zu, %zu)\n", (char*)vector, cut1, cut2);
+
+        uint32_t fragment1[cut1 + 1];
+        uint32_t fragment2[cut2 - cut1 + 1];
+        uint32_t fragment3[length - cut2 + 1];
+        memmove(fragment1, vector, cut1*sizeof(uint32_t));
+        memmove(fragment2, vector + cut1, (cut2 - cut1)*sizeof(uint32_t));
+        memmove(fragment3, vector + cut2, (length - cut2)*sizeof(uint32_t));
+
+        typename TREE::Fragment fragments[3] = {
+            {fragment1, (uint32_t)cut1},
+            {fragment2, (uint32_t)(cut2 - cut1)},
+            {fragment3, (uint32_t)(length - cut2)},
+        };
+
+        typename TREE::IndexInserted idx = tree.insert(vector, length, true);
+        typename TREE::IndexInserted idx2 = tree.insertFragments(fragments, 3, true);
+
+        memset(fragment1, 0, (cut1 + 1)*sizeof(uint32_t));
+        memset(fragment2, 0, (cut2 - cut1 + 1)*sizeof(uint32_t));
+        memset(fragment3, 0, (length - cut2 + 1)*sizeof(uint32_t));
+        tree.getFragments(idx2.getState(), fragments, 3, true);
+
+        uint32_t bufferResult[length + 1];
+        memmove(bufferResult, fragment1, (cut1 + 1)*sizeof(uint32_t));
+        memmove(bufferResult + cut1, fragment2, (cut2 - cut1 + 1)*sizeof(uint32_t));
+        memmove(bufferResult + cut2, fragment3, (length - cut2 + 1)*sizeof(uint32_t));
+
+        uint32_t bufferCorrect[length + 1];
+        memmove(bufferCorrect, vector, length*sizeof(uint32_t));
+        bufferCorrect[length] = 0;
+
+        auto r = idx.getState() != idx2.getState()
+              || memcmp(bufferCorrect, bufferResult, (length + 1)*sizeof(uint32_t));
+        if(r==0) {
+//            printf("OK!\n");
+        } else {
+            printf("\033[31mWRONG!\033[0m\n");
+            tree.printBuffer("Expected", bufferCorrect, length, 0);
+            tree.printBuffer("Obtained", bufferResult, length, 0);
+        }
+        return false;
+    }
+
+    static bool testLong(TREE& tree, uint32_t length, uint32_t offset, uint32_t deltaLength) {
+
+//        printf("  > testLong(%u, %u, %u)\n", length, offset, deltaLength);
+
+        std::vector<uint32_t> vector(length);
+        std::vector<uint32_t> deltaData(deltaLength);
+        for(uint32_t i = 0; i < length; ++i) vector[i] = i * 0x9E3779B9U;
+        for(uint32_t i = 0; i < deltaLength; ++i) deltaData[i] = ~i;
+
+        typename TREE::IndexInserted idx = tree.insert(vector.data(), length, true);
+        typename TREE::IndexInserted idx2 = tree.delta(idx.getState(), offset, deltaData.data(), deltaLength, true);
+
+        std::vector<uint32_t> bufferCorrect(vector);
+        std::copy(deltaData.begin(), deltaData.end(), bufferCorrect.begin() + offset);
+
+        std::vector<uint32_t> bufferResult(length);
+        tree.get(idx2.getState(), bufferResult.data(), true);
+        std::vector<uint32_t> bufferPartial(deltaLength + 2);
+        tree.getPartial(idx2.getState(), offset - 1, deltaLength + 2, bufferPartial.data(), true);
+
+        auto r = bufferCorrect != bufferResult
+              || !std::equal(bufferPartial.begin(), bufferPartial.end(), bufferCorrect.begin() + offset - 1);
+        if(r==0) {
+//            printf("OK!\n");
+        } else {
+            printf("\033[31mWRONG!\033[0m\n");
+        }
+        return false;
+    }
+
     static bool testExtend(TREE& tree, const char* vector, size_t offset, const char* deltaData) {
         return testExtend(tree, (uint32_t*)vector, strlen(vector)>>2, offset, strlen(deltaData)>>2, (uint32_t*)deltaData);
     }
@@ -458,4 +840,5 @@ public:
 
 private:
     TREE _tree;
+    size_t _scale;
 };
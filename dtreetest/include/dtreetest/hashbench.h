@@ -0,0 +1,100 @@
+/*
+ * Dtree - a concurrent compression tree for variable-length vectors
+ * Copyright © 2018-2021 Freark van der Berg
+ *
+ * This file is part of Dtree.
+ *
+ * Dtree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Dtree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Dtree.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <random>
+#include <vector>
+#include <dtree/dtree.h>
+
+/**
+ * Inserts vectors that resemble the states of a model checker, i.e., successors differ from their
+ * predecessor in a few slots, and reports the number of probes needed per hash set operation.
+ */
+class hashProbeBench {
+public:
+
+    hashProbeBench(size_t scale, size_t inserts, size_t length = 64): _scale(scale), _inserts(inserts), _length(length) {
+    }
+
+    template<template<typename> typename HASH>
+    void run(const char* name) {
+        using TREE = dtree<SeparateDWordRootSingleHashSet<HashSet128<RehasherExit, QuadLinear, HASH, 2>, HashSet<RehasherExit, QuadLinear, HASH, 2>>>;
+        TREE* tree = new TREE();
+        tree->setScale(_scale);
+        tree->init();
+
+        std::mt19937_64 rng(0);
+        std::vector<uint32_t> state(_length);
+        for(auto& v: state) {
+            v = rng() & 0xFF;
+        }
+        for(size_t i = 0; i < _inserts; ++i) {
+            size_t changes = 1 + rng() % 3;
+            while(changes--) {
+                state[rng() % _length] = rng() & 0xFF;
+            }
+            tree->insert(state.data(), _length, true);
+        }
+
+        auto root = tree->getRootProbeStats();
+        auto data = tree->getDataProbeStats();
+        printf("%-10s", name);
+        print("root", root);
+        print("data", data);
+        printf("\n");
+        print("root", tree->getProbeHistograms(0));
+        print("data", tree->getProbeHistograms(1));
+        delete tree;
+    }
+
+    void print(const char* name, HashSetBase::probeStats const& ps) {
+        size_t ops = ps.insertsNew + ps.insertsExisting + ps.finds;
+        printf("  %s: %10zu ops, %6.3f probes/op, %8zu failed CAS", name, ops, ops ? (double)ps.probeCount / ops : 0.0, ps.failedCAS);
+    }
+
+    void print(const char* name, HashSetBase::probeHistograms const& h) {
+        using H = HashSetBase::probeHistograms;
+        static const char* operations[H::OPERATIONS] = {"new", "existing", "find"};
+        printf("%10s", name);
+        for(size_t op = 0; op < H::OPERATIONS; ++op) {
+            if(!h.operations((H::Operation)op)) continue;
+            printf("  %s: probes p99 <= %zu max <= %zu, jumps p99 <= %zu", operations[op]
+                  , H::percentile(h.probes[op], 0.99), H::percentile(h.probes[op], 1.0), H::percentile(h.groupJumps[op], 0.99)
+                  );
+        }
+        printf("\n");
+    }
+
+    void go() {
+        printf("\n:: Probes per operation, %zu inserts of length %zu, scale %zu\n", _inserts, _length, _scale);
+        run<HashCompare>("identity");
+        run<HashMurmur64>("murmur64");
+        run<HashCRC32C>("crc32c");
+        run<HashXX64>("xx64");
+    }
+
+private:
+    size_t _scale;
+    size_t _inserts;
+    size_t _length;
+};
@@ -0,0 +1,222 @@
+/*
+ * Dtree - a concurrent compression tree for variable-length vectors
+ * Copyright © 2018-2021 Freark van der Berg
+ *
+ * This file is part of Dtree.
+ *
+ * Dtree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Dtree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Dtree.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <dtree/dtree.h>
+
+/**
+ * Tests of the hash sets and storages beneath the tree, printing WRONG for every failed check.
+ */
+class hashSetTest {
+public:
+
+    hashSetTest(size_t scale): _scale(scale) {
+    }
+
+    void go() {
+
+        printf("\n:: Testing the hash check of snapshots\n");
+
+        using QuadLinearTree = dtree<SeparateRootSingleHashSet<HashSet<RehasherExit, QuadLinear, HashMurmur64>, HashSet<RehasherExit, QuadLinear, HashMurmur64>>>;
+        using LinearTree = dtree<SeparateRootSingleHashSet<HashSet<RehasherExit, Linear, HashMurmur64>, HashSet<RehasherExit, Linear, HashMurmur64>>>;
+        using Tree128 = dtree<SeparateDWordRootSingleHashSet<HashSet128<RehasherExit, Linear>, HashSet<RehasherExit, Linear>>>;
+        using Tree128DWCAS = dtree<SeparateDWordRootSingleHashSet<HashSet128DWCAS<RehasherExit, Linear>, HashSet<RehasherExit, Linear>>>;
+
+        testSnapshotCheck<QuadLinearTree, QuadLinearTree>(true);
+        testSnapshotCheck<QuadLinearTree, LinearTree>(false);
+        testSnapshotCheck<LinearTree, QuadLinearTree>(false);
+        testSnapshotCheck<Tree128, Tree128>(true);
+        testSnapshotCheck<Tree128, Tree128DWCAS>(false);
+        testSnapshotCheck<Tree128DWCAS, Tree128>(false);
+
+        printf("\n:: Testing Rehasher under concurrent inserts\n");
+
+        testRehasher(1, 1 << 14);
+        testRehasher(4, 1 << 16);
+        testRehasher(16, 1 << 17);
+
+        printf("\n:: Testing getStats() with multiple scan threads\n");
+
+        using SegmentedTree = dtree<SeparateRootSegmentedHashSet<HashSet<RehasherExit, QuadLinear, HashMurmur64>>>;
+
+        testScanThreads<QuadLinearTree>(_scale, 3);
+        testScanThreads<QuadLinearTree>(_scale, 16);
+        testScanThreads<Tree128>(_scale, 7);
+        testScanThreads<SegmentedTree>(12, 5);
+    }
+
+    /**
+     * Fills a tree of type TREE and checks that getStats() gives the same numbers when scanning with
+     * @p threads threads as with one.
+     */
+    template<typename TREE>
+    bool testScanThreads(size_t scale, size_t threads) {
+        size_t length = 16;
+        size_t vectors = 10000;
+
+        TREE* tree = new TREE();
+        tree->setScale(scale);
+        tree->init();
+        std::vector<uint32_t> vector(length);
+        for(size_t v = 0; v < vectors; ++v) {
+            generate(v, vector.data(), length);
+            tree->insert(vector.data(), length, true);
+        }
+
+        tree->setScanThreads(1);
+        auto single = tree->getStats();
+        tree->setScanThreads(threads);
+        auto multiple = tree->getStats();
+
+        auto r = single.elements != multiple.elements
+              || single.bytesUsed != multiple.bytesUsed
+              || single.bytesReserved != multiple.bytesReserved
+              || single.elements < vectors;
+        if(r==0) {
+//            printf("OK!\n");
+        } else {
+            printf("\033[31mWRONG!\033[0m\n");
+            printf("Expected %zu elements, %zu bytes used, %zu bytes reserved\n", single.elements, single.bytesUsed, single.bytesReserved);
+            printf("Obtained %zu elements, %zu bytes used, %zu bytes reserved with %zu threads\n", multiple.elements, multiple.bytesUsed, multiple.bytesReserved, threads);
+        }
+        delete tree;
+        return r;
+    }
+
+    /**
+     * Inserts keys 1 to @p keys from @p threads threads into a hash set with a Rehasher that starts at 1024
+     * buckets, so it grows several times while the threads insert. Every thread inserts every key, starting
+     * at a different key, so the threads race on the same keys, also during migrations. Each key should be
+     * reported as inserted exactly once, and afterwards be found at a bucket holding it.
+     */
+    bool testRehasher(size_t threads, size_t keys) {
+        using HS = HashSet<Rehasher, QuadLinear, HashMurmur64>;
+        HS* set = new HS();
+        set->setScale(10);
+        set->init();
+
+        std::vector<size_t> inserted(threads);
+        std::vector<std::thread> workers;
+        for(size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([set, &inserted, threads, keys, t]() {
+                for(size_t i = 0; i < keys; ++i) {
+                    uint64_t key = 1 + (i + keys * t / threads) % keys;
+                    uint64_t result = set->insert(key);
+                    inserted[t] += (result & 0x8000000000000000ULL) != 0;
+                }
+            });
+        }
+        for(auto& w: workers) {
+            w.join();
+        }
+
+        size_t insertedTotal = 0;
+        for(size_t n: inserted) {
+            insertedTotal += n;
+        }
+        size_t lost = 0;
+        for(uint64_t key = 1; key <= keys; ++key) {
+            uint64_t result = set->insert(key);
+            uint64_t found = set->find(key);
+            lost += (result & 0x8000000000000000ULL) || found != result || set->get(found) != key;
+        }
+        size_t elements = set->getStats().elements;
+        size_t scale = set->_scale;
+
+        auto r = insertedTotal != keys || lost || elements != keys || scale < 13;
+        if(r==0) {
+//            printf("OK!\n");
+        } else {
+            printf("\033[31mWRONG!\033[0m\n");
+            printf("Expected %zu keys inserted once and found, grown to scale 13 or more\n", keys);
+            printf("Obtained %zu inserted, %zu lost, %zu in the table, scale %zu\n", insertedTotal, lost, elements, scale);
+        }
+        delete set;
+        return r;
+    }
+
+    /**
+     * Saves a tree of type SAVED, in both snapshot formats, and opens it as a tree of type OPENED, which
+     * should only succeed if @p compatible. The vectors are checked in a tree that opened the snapshot.
+     */
+    template<typename SAVED, typename OPENED>
+    bool testSnapshotCheck(bool compatible) {
+        const char* path = "hashsettest.snapshot";
+        size_t length = 16;
+        size_t vectors = 1000;
+
+        SAVED* tree = new SAVED();
+        tree->setScale(_scale);
+        tree->init();
+        std::vector<typename SAVED::Index> indices(vectors);
+        std::vector<uint32_t> vector(length);
+        for(size_t v = 0; v < vectors; ++v) {
+            generate(v, vector.data(), length);
+            indices[v] = tree->insert(vector.data(), length, true).getState();
+        }
+
+        bool r = false;
+        for(bool compact: {false, true}) {
+            if(!(compact ? tree->saveCompact(path) : tree->save(path))) {
+                printf("\033[31mWRONG!\033[0m\n");
+                r = true;
+                continue;
+            }
+            OPENED* opened = new OPENED();
+            bool ok = compact ? opened->openCompact(path) : opened->open(path);
+            if(ok != compatible) {
+                printf("\033[31mWRONG!\033[0m\n");
+                printf("Expected the %s snapshot to %s\n", compact ? "compact" : "mapped", compatible ? "open" : "be rejected");
+                r = true;
+            } else if(ok) {
+                std::vector<uint32_t> expected(length);
+                for(size_t v = 0; v < vectors; ++v) {
+                    generate(v, expected.data(), length);
+                    opened->get(indices[v].getData(), vector.data(), true);
+                    if(vector != expected) {
+                        printf("\033[31mWRONG!\033[0m\n");
+                        r = true;
+                        break;
+                    }
+                }
+            }
+            delete opened;
+            unlink(path);
+        }
+        delete tree;
+        return r;
+    }
+
+    static void generate(size_t v, uint32_t* vector, size_t length) {
+        for(size_t i = 0; i < length; ++i) {
+            vector[i] = (uint32_t)(v * length + i) * 0x9E3779B9U;
+        }
+    }
+
+private:
+    size_t _scale;
+};